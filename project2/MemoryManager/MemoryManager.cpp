@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <vector>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdint.h>
@@ -25,35 +27,171 @@
 
 #define shamt(i) (((i) & 3) << 1)
 
-MemoryManager::MemoryManager(unsigned int wordSize, MemoryAllocator allocator) :
-  word_size(wordSize), allocator(allocator), pool(nullptr) {}
+/*
+ * Profiling (MM_PROFILE) keeps log2 histograms of requested sizes and of
+ * block lifetimes, the latter measured in allocate/free calls rather than
+ * time so that runs are reproducible. Bucket 0 holds zero, bucket k holds
+ * [2^(k-1), 2^k). Call sites are the return addresses of allocate(),
+ * counted in a small open-addressed table; run them through addr2line.
+ */
+
+#define PROFILE_BUCKETS 32
+#define PROFILE_SITES 256 /* must be a power of two */
+#define PROFILE_TOP 10
+
+struct MemoryProfileSite
+{
+  void *address;
+  uint64_t count;
+  uint64_t bytes;
+};
+
+struct MemoryProfile
+{
+  uint64_t tick;
+  uint64_t allocs;
+  uint64_t failures;
+  uint64_t frees;
+  uint64_t dropped_sites;
+  uint64_t sizes[PROFILE_BUCKETS];
+  uint64_t lifetimes[PROFILE_BUCKETS];
+  MemoryProfileSite sites[PROFILE_SITES];
+  std::vector<uint64_t> birth; /* tick of allocation, by starting word */
+};
+
+static int bucket(uint64_t x)
+{
+  int b = x ? 64 - __builtin_clzll(x) : 0;
+  return b < PROFILE_BUCKETS ? b : PROFILE_BUCKETS - 1;
+}
+
+MemoryManager::MemoryManager(unsigned int wordSize, MemoryAllocator allocator, int flags) :
+  word_size(wordSize), allocator(allocator), map_size(0), flags(flags), pool(nullptr),
+  profile(flags & MM_PROFILE ? new MemoryProfile() : nullptr)
+{
+  if (flags & MM_GUARD_PAGE) {
+    this->flags |= MM_SEPARATE_MAP;
+  }
+}
+
+/* The implicit copy would leave two managers owning the same mapping,
+ * so moves steal it (and the profile) and leave the source shut down
+ * instead, without profiling but with its allocator, so that it can be
+ * initialized again. */
+MemoryManager::MemoryManager(MemoryManager&& other) :
+  word_size(other.word_size), allocator(other.allocator),
+  num_words(other.num_words), pool_size(other.pool_size),
+  total_size(other.total_size), map_size(other.map_size), flags(other.flags),
+  pool(other.pool), map(other.map), profile(other.profile)
+{
+  other.pool = nullptr;
+  other.profile = nullptr;
+  other.flags &= ~MM_PROFILE;
+}
+
+MemoryManager& MemoryManager::operator=(MemoryManager&& other)
+{
+  if (this != &other) {
+    shutdown();
+    word_size = other.word_size;
+    allocator = other.allocator;
+    num_words = other.num_words;
+    pool_size = other.pool_size;
+    total_size = other.total_size;
+    map_size = other.map_size;
+    flags = other.flags;
+    pool = other.pool;
+    map = other.map;
+    delete profile;
+    profile = other.profile;
+    other.pool = nullptr;
+    other.profile = nullptr;
+    other.flags &= ~MM_PROFILE;
+  }
+  return *this;
+}
 
 MemoryManager::~MemoryManager()
 {
   shutdown();
+  delete profile;
 }
 
 void MemoryManager::initialize(size_t sizeInWords)
 {
-  shutdown();
-  num_words = sizeInWords;
-  pool_size = num_words * word_size;
-  total_size = pool_size + (num_words >> 2) + 1;
-
-  /* Don't use stdlib or new? Challenge accepted.
-   * mmap is slowly becoming my favorite system call.
-   * Bonus: The memory is automatically initialized to zero. */
-  pool = static_cast<unsigned char *>(mmap(nullptr, total_size,
-      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
-  map = pool + pool_size;
+  unsigned int page = sysconf(_SC_PAGESIZE);
+  unsigned int pool_need = sizeInWords * word_size;
+  unsigned int map_need = (sizeInWords >> 2) + 1;
+
+  /* With MM_SEPARATE_MAP the map gets its own page-aligned mapping, so
+   * writes to the end of the pool never touch the same cache line (or
+   * page) as the allocator metadata. MM_GUARD_PAGE additionally puts an
+   * inaccessible page after the pool to catch overruns. */
+  if (flags & MM_SEPARATE_MAP) {
+    pool_need = (pool_need + page - 1) & ~(page - 1);
+    if (flags & MM_GUARD_PAGE) {
+      pool_need += page;
+    }
+    map_need = (map_need + page - 1) & ~(page - 1);
+  } else {
+    pool_need += map_need;
+    map_need = 0;
+  }
+
+  /* If the new pool and map fit in what we already have mapped, keep the
+   * mapping and its faulted-in pages. Only the map needs to be cleared;
+   * the pool is left as is unless MM_RELEASE asks for fresh zero pages.
+   * The guard page moves to just after the new pool. */
+  if (pool && pool_need <= total_size && map_need <= map_size) {
+    if (flags & MM_GUARD_PAGE) {
+      mprotect(pool, total_size, PROT_READ | PROT_WRITE);
+      mprotect(pool + pool_need - page, page, PROT_NONE);
+    }
+    num_words = sizeInWords;
+    pool_size = num_words * word_size;
+    if (!(flags & MM_SEPARATE_MAP)) {
+      map = pool + pool_size;
+    }
+    memset(map, 0, (num_words >> 2) + 1);
+    if (flags & MM_RELEASE) {
+      madvise(pool, pool_size & ~(page - 1), MADV_DONTNEED);
+    }
+  } else {
+    shutdown();
+    num_words = sizeInWords;
+    pool_size = num_words * word_size;
+    total_size = pool_need;
+    map_size = map_need;
+
+    /* Don't use stdlib or new? Challenge accepted.
+     * mmap is slowly becoming my favorite system call.
+     * Bonus: The memory is automatically initialized to zero. */
+    pool = static_cast<unsigned char *>(mmap(nullptr, total_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (flags & MM_SEPARATE_MAP) {
+      if (flags & MM_GUARD_PAGE) {
+        mprotect(pool + total_size - page, page, PROT_NONE);
+      }
+      map = static_cast<unsigned char *>(mmap(nullptr, map_size,
+          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    } else {
+      map = pool + pool_size;
+    }
+  }
   map[0] = 1;
   map[num_words >> 2] |= 2 << shamt(num_words);
+  if (profile) {
+    profile->birth.assign(num_words, 0);
+  }
 }
 
 void MemoryManager::shutdown()
 {
   if (pool) {
     munmap(pool, total_size);
+    if (map_size) {
+      munmap(map, map_size);
+    }
     pool = nullptr;
   }
 }
@@ -67,6 +205,9 @@ void *MemoryManager::allocate(size_t size)
   uint16_t *list = static_cast<uint16_t *>(getList());
   int i = allocator(size_words, list);
   delete[] list;
+  if (profile) {
+    profileAllocate(i, size, __builtin_return_address(0));
+  }
   if (i < 0) {
     return nullptr;
   }
@@ -82,6 +223,9 @@ void MemoryManager::free(void *address)
     return;
   }
   int i = (static_cast<unsigned char *>(address) - pool) / word_size;
+  if (profile) {
+    profileFree(i);
+  }
   map[i >> 2] &= ~(2 << shamt(i));
   do ++i;
   while (!(map[i >> 2] & 1 << shamt(i)));
@@ -117,6 +261,123 @@ int MemoryManager::dumpMemoryMap(char *filename)
   return 0;
 }
 
+void MemoryManager::profileAllocate(int i, size_t size, void *site)
+{
+  ++profile->tick;
+  ++profile->sizes[bucket(size)];
+  if (i < 0) {
+    ++profile->failures;
+    return;
+  }
+  ++profile->allocs;
+  profile->birth[i] = profile->tick;
+
+  uintptr_t h = reinterpret_cast<uintptr_t>(site);
+  h = (h ^ h >> 17) * 0x9e3779b97f4a7c15;
+  for (int n = 0; n < PROFILE_SITES; ++n, ++h) {
+    MemoryProfileSite& s = profile->sites[h & (PROFILE_SITES - 1)];
+    if (!s.address || s.address == site) {
+      s.address = site;
+      ++s.count;
+      s.bytes += size;
+      return;
+    }
+  }
+  ++profile->dropped_sites;
+}
+
+void MemoryManager::profileFree(int i)
+{
+  ++profile->tick;
+  ++profile->frees;
+  ++profile->lifetimes[bucket(profile->tick - profile->birth[i])];
+}
+
+static void dump_histogram(int fd, const char *key, const char *title, const uint64_t *hist, bool json)
+{
+  bool first = true;
+  if (json) {
+    dprintf(fd, ",\n  \"%s\": [", key);
+  } else {
+    dprintf(fd, "\n%-24s %12s\n", title, "count");
+  }
+  for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+    if (!hist[b]) {
+      continue;
+    }
+    uint64_t lo = b ? 1ull << (b - 1) : 0;
+    uint64_t hi = b ? (1ull << b) - 1 : 0;
+    if (json) {
+      dprintf(fd, "%s\n    {\"min\": %llu, \"max\": %llu, \"count\": %llu}", first ? "" : ",",
+          (unsigned long long)lo, (unsigned long long)hi, (unsigned long long)hist[b]);
+    } else {
+      char range[48];
+      sprintf(range, "[%llu, %llu]", (unsigned long long)lo, (unsigned long long)hi);
+      dprintf(fd, "%-24s %12llu\n", range, (unsigned long long)hist[b]);
+    }
+    first = false;
+  }
+  if (json) {
+    dprintf(fd, "\n  ]");
+  }
+}
+
+int MemoryManager::dumpProfile(char *filename, bool json)
+{
+  if (!profile) {
+    return -1;
+  }
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return -1;
+  }
+
+  std::vector<MemoryProfileSite> top;
+  for (MemoryProfileSite& s : profile->sites) {
+    if (s.address) {
+      top.push_back(s);
+    }
+  }
+  size_t n = std::min<size_t>(top.size(), PROFILE_TOP);
+  std::partial_sort(top.begin(), top.begin() + n, top.end(),
+      [](const MemoryProfileSite& a, const MemoryProfileSite& b) { return a.count > b.count; });
+
+  unsigned long long allocs = profile->allocs;
+  unsigned long long failures = profile->failures;
+  unsigned long long frees = profile->frees;
+  unsigned long long dropped = profile->dropped_sites;
+  if (json) {
+    dprintf(fd, "{\n  \"allocations\": %llu,\n  \"failures\": %llu,\n  \"frees\": %llu,\n"
+        "  \"dropped_sites\": %llu", allocs, failures, frees, dropped);
+  } else {
+    dprintf(fd, "allocations %llu (%llu failed)\nfrees %llu\n", allocs, failures, frees);
+    if (dropped) {
+      dprintf(fd, "%llu allocations from untracked call sites\n", dropped);
+    }
+  }
+  dump_histogram(fd, "sizes", "size (bytes)", profile->sizes, json);
+  dump_histogram(fd, "lifetimes", "lifetime (calls)", profile->lifetimes, json);
+  if (json) {
+    dprintf(fd, ",\n  \"sites\": [");
+  } else {
+    dprintf(fd, "\n%-24s %12s %12s\n", "call site", "count", "bytes");
+  }
+  for (size_t k = 0; k < n; ++k) {
+    if (json) {
+      dprintf(fd, "%s\n    {\"address\": \"%p\", \"count\": %llu, \"bytes\": %llu}", k ? "," : "",
+          top[k].address, (unsigned long long)top[k].count, (unsigned long long)top[k].bytes);
+    } else {
+      dprintf(fd, "%-24p %12llu %12llu\n",
+          top[k].address, (unsigned long long)top[k].count, (unsigned long long)top[k].bytes);
+    }
+  }
+  if (json) {
+    dprintf(fd, "\n  ]\n}\n");
+  }
+  close(fd);
+  return 0;
+}
+
 void *MemoryManager::getList()
 {
   if (!pool) {
@@ -7,6 +7,14 @@
 
 typedef std::function<int(int, void *)> MemoryAllocator;
 
+/* Flags for the MemoryManager constructor. */
+#define MM_RELEASE 0x1 /* discard pool pages when initialize() reuses the mapping */
+#define MM_SEPARATE_MAP 0x2 /* keep the map in its own page-aligned mapping */
+#define MM_GUARD_PAGE 0x4 /* inaccessible page after the pool (implies MM_SEPARATE_MAP) */
+#define MM_PROFILE 0x8 /* record size/lifetime histograms and call sites */
+
+struct MemoryProfile;
+
 class MemoryManager
 {
   unsigned int word_size;
@@ -14,11 +22,19 @@ class MemoryManager
   unsigned int num_words;
   unsigned int pool_size;
   unsigned int total_size;
+  unsigned int map_size;
+  int flags;
   unsigned char *pool;
   unsigned char *map;
+  MemoryProfile *profile;
+
+  void profileAllocate(int i, size_t size, void *site);
+  void profileFree(int i);
 
 public:
-  MemoryManager(unsigned int wordSize, MemoryAllocator allocator);
+  MemoryManager(unsigned int wordSize, MemoryAllocator allocator, int flags = 0);
+  MemoryManager(MemoryManager&& other);
+  MemoryManager& operator=(MemoryManager&& other);
   ~MemoryManager();
   void initialize(size_t sizeInWords);
   void shutdown();
@@ -26,6 +42,7 @@ public:
   void free(void *address);
   void setAllocator(MemoryAllocator allocator);
   int dumpMemoryMap(char *filename);
+  int dumpProfile(char *filename, bool json = false);
   void *getList();
   void *getBitmap();
   unsigned int getWordSize();
@@ -0,0 +1,103 @@
+/*
+ * Multi-threaded allocate/free benchmark comparing map layouts.
+ *
+ * MemoryManager is not thread-safe, so every thread gets its own manager
+ * and nothing is locked. Each thread allocates a block, fills it, and
+ * frees it again. Blocks near the end of the pool are the interesting
+ * ones: with the default layout they share cache lines with the start of
+ * the map, so every fill evicts the metadata the next allocate reads.
+ * Each thread is timed on its own, so a slow one shows up instead of
+ * being averaged away.
+ *
+ * usage: bench.out [threads] [iterations]
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "MemoryManager/MemoryManager.h"
+
+static const int num_words = 1024;
+static const int word_size = 8;
+
+/* Prefer the last hole so that blocks end up against the map. */
+static int lastFit(int sizeInWords, void *list)
+{
+  uint16_t *p = static_cast<uint16_t *>(list);
+  int count = *p;
+  int result = -1;
+  while (count--) {
+    int offset = *(++p);
+    int len = *(++p);
+    if (len >= sizeInWords) {
+      result = offset + len - sizeInWords;
+    }
+  }
+  return result;
+}
+
+/* Returns the wall time of the whole run; secs gets each thread's own. */
+static double run(int flags, int threads, int iterations, std::vector<double>& secs)
+{
+  auto worker = [&](int id) {
+    MemoryManager mm(word_size, lastFit, flags);
+    mm.initialize(num_words);
+    unsigned int seed = id;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      size_t size = (rand_r(&seed) % 8 + 1) * word_size;
+      void *p = mm.allocate(size);
+      if (!p) {
+        continue;
+      }
+      for (int j = 0; j < 16; ++j) {
+        memset(p, j, size);
+      }
+      mm.free(p);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    secs[id] = elapsed.count();
+  };
+
+  secs.assign(threads, 0);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (int i = 0; i < threads; ++i) {
+    pool.emplace_back(worker, i);
+  }
+  for (std::thread& t : pool) {
+    t.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  int iterations = argc > 2 ? atoi(argv[2]) : 100000;
+
+  static const struct {
+    const char *name;
+    int flags;
+  } layouts[] = {
+    { "inline", 0 },
+    { "separate", MM_SEPARATE_MAP },
+    { "separate+guard", MM_GUARD_PAGE },
+  };
+
+  printf("%d threads, %d iterations each\n", threads, iterations);
+  std::vector<double> secs;
+  for (auto& layout : layouts) {
+    double total = run(layout.flags, threads, iterations, secs);
+    printf("%-16s %8.3f s %10.0f ops/s\n", layout.name, total,
+        threads * (double)iterations / total);
+    for (int i = 0; i < threads; ++i) {
+      printf("  thread %-7d %8.3f s %10.0f ops/s\n", i, secs[i], iterations / secs[i]);
+    }
+  }
+  return 0;
+}
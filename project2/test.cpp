@@ -6,6 +6,9 @@
 #include <fstream>
 #include <vector>
 #include <iostream>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 
 
@@ -20,6 +23,11 @@ unsigned int testRepeatedShutdown();
 unsigned int testMaxInitialization();
 unsigned int testGetters();
 unsigned int testReadingUsingGetMemoryStart();
+unsigned int testMoveSemantics();
+unsigned int testReuseAfterShrink();
+unsigned int testReuseAfterGrow();
+unsigned int testGuardPageReuse();
+unsigned int testDumpProfile();
 
 
 // helper functions
@@ -29,6 +37,8 @@ unsigned int testGetList(MemoryManager& memoryManager, uint16_t correctListLengt
 unsigned int testGetWordSize(MemoryManager& memoryManager, size_t correctWordSize);
 unsigned int testGetMemoryLimit(MemoryManager& memoryManager, size_t correctMemoryLimit);
 unsigned int testDumpMemoryMap(MemoryManager& memoryManager, std::string fileName, std::string correctFileContents);
+unsigned int testCheck(std::string description, bool correct);
+bool writeFaults(void* address);
 
 int hopesAndDreamsAllocator(int sizeInWords, void* list)
 {
@@ -78,7 +88,7 @@ int hopesAndDreamsAllocator(int sizeInWords, void* list)
 
 int main()
 {
-    unsigned int maxScore = 38;
+    unsigned int maxScore = 51;
     unsigned int score = 0;
     
     score += testMemoryLeaksNoShutdown(); // 0
@@ -108,6 +118,21 @@ int main()
     std::cout << "Score: " << score << " / " <<  maxScore << std::endl;
     
     score += 5 * testReadingUsingGetMemoryStart(); // 1 * 5
+    std::cout << "Score: " << score << " / " <<  maxScore << std::endl;
+
+    score += testMoveSemantics(); // 4
+    std::cout << "Score: " << score << " / " <<  maxScore << std::endl;
+
+    score += testReuseAfterShrink(); // 2
+    std::cout << "Score: " << score << " / " <<  maxScore << std::endl;
+
+    score += testReuseAfterGrow(); // 2
+    std::cout << "Score: " << score << " / " <<  maxScore << std::endl;
+
+    score += testGuardPageReuse(); // 2
+    std::cout << "Score: " << score << " / " <<  maxScore << std::endl;
+
+    score += testDumpProfile(); // 3
     
     std::cout << "Score: " << score << " / " <<  maxScore << std::endl;
 }
@@ -604,6 +629,186 @@ unsigned int testReadingUsingGetMemoryStart()
     return score;
 }
 
+unsigned int testMoveSemantics()
+{
+    std::cout << "Test Case: Move Semantics" << std::endl;
+    unsigned int score = 0;
+
+    MemoryManager source(8, bestFit, MM_PROFILE);
+    source.initialize(26);
+    void* start = source.getMemoryStart();
+    source.allocate(sizeof(uint64_t) * 10);
+
+    std::cout << "moving a manager..." << std::endl;
+    MemoryManager moved(std::move(source));
+    std::vector<uint16_t> correctList = {10, 16};
+    score += testGetList(moved, correctList.size() * 2, correctList);
+    score += testCheck("moved-from manager is shut down and no longer profiles",
+        moved.getMemoryStart() == start && source.getMemoryStart() == nullptr
+        && source.dumpProfile((char*)"testMoveSemantics.txt") == -1);
+
+    std::cout << "reusing the moved-from manager..." << std::endl;
+    source.initialize(10);
+    source.allocate(sizeof(uint64_t) * 4);
+    correctList = {4, 6};
+    score += testGetList(source, correctList.size() * 2, correctList);
+
+    std::cout << "move assigning a manager..." << std::endl;
+    MemoryManager target(8, worstFit);
+    target.initialize(5);
+    target = std::move(moved);
+    score += testCheck("move assignment takes the pool and the profile",
+        target.getMemoryStart() == start && moved.getMemoryStart() == nullptr
+        && target.dumpProfile((char*)"testMoveSemantics.txt") == 0
+        && moved.dumpProfile((char*)"testMoveSemantics.txt") == -1);
+
+    return score;
+}
+
+unsigned int testReuseAfterShrink()
+{
+    std::cout << "Test Case: Reuse After Shrink" << std::endl;
+    unsigned int score = 0;
+
+    MemoryManager memoryManager(8, bestFit);
+    memoryManager.initialize(100);
+    uint64_t* testArray1 = static_cast<uint64_t*>(memoryManager.allocate(sizeof(uint64_t) * 100));
+    for(uint16_t i = 0; i < 100; ++i) {
+        testArray1[i] = i;
+    }
+
+    std::cout << "reinitializing with fewer words..." << std::endl;
+    memoryManager.initialize(40);
+    std::vector<uint16_t> correctList = {0, 40};
+    score += testGetList(memoryManager, correctList.size() * 2, correctList);
+
+    uint64_t* testArray2 = static_cast<uint64_t*>(memoryManager.allocate(sizeof(uint64_t) * 40));
+    bool correct = testArray2 == memoryManager.getMemoryStart()
+        && memoryManager.getMemoryLimit() == 320
+        && memoryManager.allocate(sizeof(uint64_t)) == nullptr;
+    if(correct) {
+        testArray2[39] = 39;
+    }
+    score += testCheck("the whole smaller pool and no more is handed out", correct);
+
+    memoryManager.shutdown();
+    return score;
+}
+
+unsigned int testReuseAfterGrow()
+{
+    std::cout << "Test Case: Reuse After Grow" << std::endl;
+    unsigned int score = 0;
+
+    MemoryManager memoryManager(8, bestFit, MM_SEPARATE_MAP);
+    memoryManager.initialize(100);
+    void* start = memoryManager.getMemoryStart();
+    memoryManager.initialize(40);
+    memoryManager.allocate(sizeof(uint64_t) * 40);
+
+    std::cout << "reinitializing with more words..." << std::endl;
+    memoryManager.initialize(90);
+    std::vector<uint16_t> correctList = {0, 90};
+    score += testGetList(memoryManager, correctList.size() * 2, correctList);
+
+    uint64_t* testArray1 = static_cast<uint64_t*>(memoryManager.allocate(sizeof(uint64_t) * 90));
+    bool correct = testArray1 == start && memoryManager.getMemoryLimit() == 720;
+    if(correct) {
+        for(uint16_t i = 0; i < 90; ++i) {
+            testArray1[i] = i;
+        }
+        memoryManager.free(testArray1);
+        correct = memoryManager.allocate(sizeof(uint64_t) * 90) == start;
+    }
+    score += testCheck("the grown pool reuses the mapping and is usable", correct);
+
+    memoryManager.shutdown();
+    return score;
+}
+
+unsigned int testGuardPageReuse()
+{
+    std::cout << "Test Case: Guard Page Reuse" << std::endl;
+    unsigned int score = 0;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    MemoryManager memoryManager(8, bestFit, MM_GUARD_PAGE);
+    memoryManager.initialize(2 * page / 8);
+    char* start = static_cast<char*>(memoryManager.getMemoryStart());
+
+    std::cout << "reinitializing with one page of words..." << std::endl;
+    memoryManager.initialize(page / 8);
+    score += testCheck("the page after the smaller pool is guarded",
+        memoryManager.getMemoryStart() == start && !writeFaults(start + page - 1) && writeFaults(start + page));
+
+    std::cout << "reinitializing with two pages of words..." << std::endl;
+    memoryManager.initialize(2 * page / 8);
+    score += testCheck("the old guard page is usable again and the new one guarded",
+        memoryManager.getMemoryStart() == start && !writeFaults(start + page)
+        && !writeFaults(start + 2 * page - 1) && writeFaults(start + 2 * page));
+
+    memoryManager.shutdown();
+    return score;
+}
+
+unsigned int testDumpProfile()
+{
+    std::cout << "Test Case: dumpProfile" << std::endl;
+    unsigned int score = 0;
+
+    MemoryManager memoryManager(8, bestFit, MM_PROFILE);
+    memoryManager.initialize(100);
+
+    std::cout << "allocating known sizes from one call site..." << std::endl;
+    std::vector<size_t> sizes{8, 9, 15, 100, 120, 10000};
+    std::vector<void*> blocks;
+    for(size_t size: sizes) {
+        blocks.push_back(memoryManager.allocate(size));
+    }
+    memoryManager.free(blocks[0]);
+    memoryManager.free(blocks[3]);
+
+    std::string fileName = "testDumpProfile.txt";
+    memoryManager.dumpProfile((char*)fileName.c_str());
+    std::ifstream testFile(fileName);
+    std::vector<std::string> lines;
+    for(std::string line; std::getline(testFile, line);) {
+        lines.push_back(line);
+    }
+
+    // the last column of the line starting with prefix, or "" if there is none
+    auto count = [&](const std::string& prefix) {
+        for(const std::string& line: lines) {
+            if(line.compare(0, prefix.size(), prefix) == 0) {
+                return line.substr(line.find_last_of(' ') + 1);
+            }
+        }
+        return std::string();
+    };
+
+    score += testCheck("allocation and free totals",
+        lines.size() > 1 && lines[0] == "allocations 5 (1 failed)" && lines[1] == "frees 2");
+    // lifetimes count allocate/free calls, failures included: 7 - 1 and 8 - 4
+    score += testCheck("size and lifetime histograms",
+        count("[8, 15]") == "3" && count("[64, 127]") == "2" && count("[8192, 16383]") == "1"
+        && count("[16, 31]") == "" && count("[4, 7]") == "2");
+
+    // one call site: 5 successful allocations of 8 + 9 + 15 + 100 + 120 bytes
+    std::vector<std::string> sites;
+    for(size_t i = 0; i < lines.size(); ++i) {
+        if(lines[i].compare(0, 9, "call site") == 0) {
+            sites.assign(lines.begin() + i + 1, lines.end());
+        }
+    }
+    std::istringstream site(sites.empty() ? "" : sites[0]);
+    std::string address, siteCount, siteBytes;
+    site >> address >> siteCount >> siteBytes;
+    score += testCheck("call site counts", sites.size() == 1 && siteCount == "5" && siteBytes == "252");
+
+    memoryManager.shutdown();
+    return score;
+}
+
 
 std::string vectorToString(const std::vector<uint16_t>& vector)
 {
@@ -761,6 +966,26 @@ unsigned int testDumpMemoryMap(MemoryManager& memoryManager, std::string fileNam
     return 0;
 }
 
+unsigned int testCheck(std::string description, bool correct)
+{
+    std::cout << "Testing " << description << std::endl;
+    if(correct) {
+        std::cout << "[CORRECT]\n" << std::endl;
+        return 1;
+    }
+    std::cout << "[INCORRECT]\n" << std::endl;
+    return 0;
+}
 
-
-
+// writes to address in a child process, so a fault doesn't end the tests
+bool writeFaults(void* address)
+{
+    pid_t pid = fork();
+    if(pid == 0) {
+        *static_cast<volatile char*>(address) = 1;
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
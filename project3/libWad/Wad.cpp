@@ -1,10 +1,25 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #include "Wad.h"
 
@@ -29,6 +44,14 @@ static bool is_end(const char *name)
   return namelen >= 4 && !memcmp(name + namelen - 4, "_END", 4);
 }
 
+/* An unused slot in the descriptor table, all zeroes as Wad::insert
+ * writes them. A lump that merely has no name is still a lump. */
+static bool is_blank(const WadDescriptor *desc)
+{
+  static const WadDescriptor blank {};
+  return !memcmp(desc, &blank, sizeof(blank));
+}
+
 static bool is_file(const WadDescriptor *desc)
 {
   return desc && !(desc == WAD_ROOT || is_start(desc->name) || is_map(desc->name));
@@ -56,66 +79,452 @@ void Wad::skip(WadDescriptor *& desc)
 
 Wad::~Wad()
 {
+  if (flusher.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(flusher_lock);
+      flusher_stop = true;
+    }
+    flusher_wake.notify_one();
+    flusher.join();
+  }
+  /* Callbacks may start new requests, so go until none are left. */
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> guard(async_ring.lock);
+      if (!drain_async()) {
+        fail_async();
+      }
+      if (async_done.empty()) {
+        break;
+      }
+    }
+    runCompletions();
+  }
+  if (async_fd >= 0) {
+    close(async_fd);
+  }
+  commitBatch();
+  flush();
+  if (lazy_table) {
+    munmap(lazy_map, lazy_map_size);
+  }
+  if (mapping) {
+    munmap(mapping, mapping_size);
+  }
   close(fd);
 }
 
+/* (Re)map the whole file for WAD_MMAP. The mapping is shared, so it sees
+ * our own pwrites, but it has to be redone whenever the file grows. */
+void Wad::map_file()
+{
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size == mapping_size) {
+    return;
+  }
+  if (mapping) {
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+  if (!st.st_size) {
+    return;
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    return;
+  }
+  mapping = static_cast<char *>(addr);
+  mapping_size = st.st_size;
+  if (flags & WAD_SEQUENTIAL) {
+    madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+  } else if (flags & WAD_RANDOM) {
+    madvise(mapping, mapping_size, MADV_RANDOM);
+  }
+}
+
 #define WAD_ITER(d, body) \
   if (d == WAD_ROOT) { \
-    for (d = descriptors.data(); d != descriptors.data() + descriptors.size(); skip(d)) body; \
+    for (d = table(); d != table() + table_size(); skip(d)) body; \
   } else if (is_start(d->name)) { \
     for (++d; !is_end(d->name); skip(d)) body; \
   } else if (is_map(d->name)) { \
     ++d; for (int i = 0; i < 10; ++i, ++d) body; \
   }
 
-WadDescriptor *Wad::resolve(const std::string& path, char *create_name)
+/* Turns "//a//b/" into "/a/b", rejecting relative paths and components
+ * that cannot fit in a descriptor name. The root is "/". */
+static bool normalize(const std::string& path, std::string& out)
 {
   const char *s = path.c_str();
-  WadDescriptor *desc = WAD_ROOT;
-  char component[8];
-  char name[8];
-
   if (*s != '/') {
-    return nullptr;
-  }
-  while (*(++s) == '/');
-
-next:
-  if (!*s) {
-    return create_name ? nullptr : desc;
+    return false;
   }
-  const char *begin = s;
-  while (*s && *s != '/') {
-    ++s;
+  out.clear();
+  for (;;) {
+    while (*s == '/') {
+      ++s;
+    }
+    if (!*s) {
+      break;
+    }
+    const char *begin = s;
+    while (*s && *s != '/') {
+      ++s;
+    }
+    if (s - begin > 8) {
+      return false;
+    }
+    out += '/';
+    out.append(begin, s - begin);
   }
-  if (s - begin > 8) {
-    return nullptr;
+  if (out.empty()) {
+    out = "/";
   }
-  memset(component, 0, sizeof(component));
-  memcpy(component, begin, s - begin);
-  while (*s == '/') {
-    ++s;
+  return true;
+}
+
+static std::string entry_name(const WadDescriptor *desc)
+{
+  size_t namelen = strnlen(desc->name, sizeof(desc->name));
+  if (is_start(desc->name)) {
+    namelen -= 6;
   }
+  return std::string(desc->name, namelen);
+}
+
+/*
+ * The index mirrors the directory structure implied by the descriptor
+ * table: each node knows its position in the table and its children, and
+ * every path maps straight to its node. Lookups are a single hash of the
+ * normalized path instead of a walk over the table. When two entries in
+ * a directory share a name, the first one wins, as it always has.
+ */
+
+void Wad::build_index(uint32_t id, const std::string& prefix, bool recurse)
+{
+  nodes[id].listed = true;
+  WadDescriptor *desc = descriptor(id);
   WAD_ITER(desc, {
-    memcpy(name, desc->name, sizeof(name));
+    if (is_blank(desc)) {
+      continue;
+    }
+    uint32_t index = desc - table();
+    uint32_t end = index;
     if (is_start(desc->name)) {
-      memset(name + strnlen(name, sizeof(name)) - 6, 0, 6);
+      WadDescriptor *d = desc;
+      skip(d);
+      end = d - table() - 1;
     }
-    if (!memcmp(component, name, sizeof(name))) {
-      goto next;
+    std::string path = prefix + "/" + entry_name(desc);
+    uint32_t child = add_node(id, index, end, path);
+    if (is_dir(desc)) {
+      if (recurse) {
+        build_index(child, path, true);
+      } else {
+        nodes[child].listed = false;
+      }
     }
-  }) else {
-    return nullptr;
+  })
+}
+
+/*
+ * With WAD_LAZY, the descriptor table stays in a read-only mapping and a
+ * directory's entries only go into the index when something looks inside
+ * it. Looking up a path lists each directory on the way down; listing a
+ * directory still has to skip over its subdirectories in the table, but
+ * that is a scan of the mapping, and nothing is kept for them. Anything
+ * that changes the file first reads in the whole table and finishes the
+ * index (materialize), and from then on the Wad works as usual.
+ *
+ * Lookups happen under the shared lock, so listing a directory has to
+ * drop it and take the exclusive one.
+ */
+
+WadDescriptor *Wad::table()
+{
+  return lazy_table ? lazy_table : descriptors.data();
+}
+
+uint32_t Wad::table_size()
+{
+  return lazy_table ? lazy_count : descriptors.size();
+}
+
+std::string Wad::node_path(uint32_t id)
+{
+  std::string path;
+  for (; id; id = nodes[id].parent) {
+    path.insert(0, "/" + entry_name(descriptor(id)));
+  }
+  return path.empty() ? "/" : path;
+}
+
+uint32_t Wad::load_path(const std::string& path)
+{
+  std::string key;
+  if (!normalize(path, key)) {
+    return WAD_NONE;
+  }
+  uint32_t id = 0;
+  size_t end = 0;
+  while (end < key.size() && end != std::string::npos) {
+    if (!nodes[id].listed) {
+      build_index(id, id ? key.substr(0, end) : "", false);
+    }
+    end = key.find('/', end + 1);
+    auto it = paths.find(key.substr(0, end));
+    if (it == paths.end()) {
+      return WAD_NONE;
+    }
+    id = it->second;
+  }
+  return id;
+}
+
+std::shared_lock<WadLock> Wad::lock_listed(uint32_t id)
+{
+  std::shared_lock<WadLock> guard(lock);
+  if (id < nodes.size() && !nodes[id].listed) {
+    guard.unlock();
+    {
+      std::unique_lock<WadLock> writer(lock);
+      if (!nodes[id].listed) {
+        build_index(id, id ? node_path(id) : "", false);
+      }
+    }
+    guard.lock();
+  }
+  return guard;
+}
+
+void Wad::materialize()
+{
+  if (!lazy_table) {
+    return;
+  }
+  descriptors.assign(lazy_table, lazy_table + lazy_count);
+  munmap(lazy_map, lazy_map_size);
+  lazy_table = nullptr;
+  for (uint32_t id = 0; id < nodes.size(); ++id) {
+    if (!nodes[id].listed) {
+      build_index(id, id ? node_path(id) : "", true);
+    }
+  }
+  find_data_end();
+  count_shares();
+}
+
+void Wad::find_data_end()
+{
+  dend = sizeof(WadHeader);
+  for (WadDescriptor& desc : descriptors) {
+    if (desc.size) {
+      dend = std::max(dend, desc.offset + desc.size);
+    }
+  }
+}
+
+/* Account for count descriptors inserted at index. */
+void Wad::shift_index(uint32_t index, uint32_t count)
+{
+  for (auto node = nodes.begin() + 1; node != nodes.end(); ++node) {
+    if (node->index >= index) {
+      node->index += count;
+    }
+    if (node->end >= index) {
+      node->end += count;
+    }
+  }
+}
+
+uint32_t Wad::add_node(uint32_t parent, uint32_t index, uint32_t end, const std::string& path)
+{
+  uint32_t id = nodes.size();
+  nodes.push_back({ index, end, parent, {}, true });
+  nodes[parent].children.push_back(id);
+  paths.emplace(path, id);
+  return id;
+}
+
+uint32_t Wad::lookup(const std::string& path)
+{
+  std::string key;
+  if (!normalize(path, key)) {
+    return WAD_NONE;
+  }
+  auto it = paths.find(key);
+  return it == paths.end() ? WAD_NONE : it->second;
+}
+
+/* Find the directory a new entry at path would go in. The entry must not
+ * exist yet, and only the root and namespace (_START/_END) directories
+ * can grow; map directories always have exactly ten entries. */
+uint32_t Wad::lookup_parent(const std::string& path, char *name, std::string& key)
+{
+  if (!normalize(path, key) || key == "/" || paths.count(key)) {
+    return WAD_NONE;
+  }
+  size_t slash = key.rfind('/');
+  auto it = paths.find(slash ? key.substr(0, slash) : "/");
+  if (it == paths.end() || (it->second && !is_start(descriptor(it->second)->name))) {
+    return WAD_NONE;
+  }
+  memcpy(name, key.data() + slash + 1, key.size() - slash - 1);
+  return it->second;
+}
+
+/*
+ * New entries go at the end of their directory. If the directory has
+ * blank descriptors (free slots) right before its end, they are used
+ * and only those slots need to be written. Otherwise the table is
+ * opened up, which moves everything after it; with WAD_SLACK some
+ * extra free slots are reserved at the same time so that the next
+ * inserts into this directory are cheap.
+ */
+
+#define SLACK_SLOTS 8
+
+uint32_t Wad::insert(uint32_t parent, const WadDescriptor *descs, uint32_t count)
+{
+  if (batching) {
+    uint32_t index = descriptors.size();
+    descriptors.insert(descriptors.end(), descs, descs + count);
+    if ((!parent || nodes[parent].index < batch_base)
+        && std::find(batch_parents.begin(), batch_parents.end(), parent) == batch_parents.end()) {
+      batch_parents.push_back(parent);
+    }
+    return index;
+  }
+  uint32_t end = parent ? nodes[parent].end : descriptors.size();
+  uint32_t index = end;
+  while (index > 0 && is_blank(&descriptors[index - 1])) {
+    --index;
+  }
+  if (end - index >= count) {
+    std::copy(descs, descs + count, descriptors.begin() + index);
+    update(index, index + count);
+    return index;
+  }
+  uint32_t extra = count - (end - index) + (flags & WAD_SLACK ? SLACK_SLOTS : 0);
+  descriptors.insert(descriptors.begin() + end, extra, WadDescriptor {});
+  shift_index(end, extra);
+  std::copy(descs, descs + count, descriptors.begin() + index);
+  update(index, descriptors.size());
+  return index;
+}
+
+/*
+ * Between beginBatch() and commitBatch(), new entries are appended to the
+ * end of the descriptor vector instead of being inserted where they
+ * belong, and nothing is written. Nodes and paths are updated right away,
+ * so lookups (and creating entries inside new directories) work as usual.
+ * commitBatch() then merges everything into place in a single pass over
+ * the table, using free slots where it can, and writes the table once.
+ */
+
+void Wad::beginBatch()
+{
+  std::unique_lock<WadLock> guard(lock);
+  materialize();
+  if (!batching) {
+    batching = true;
+    batch_base = descriptors.size();
+    batch_from = WAD_NONE;
+    batch_parents.clear();
+  }
+}
+
+/* Append a new entry (and its subtree) to the merged table. */
+void Wad::emit(uint32_t id, std::vector<WadDescriptor>& table, std::vector<uint32_t>& remap)
+{
+  WadNode& node = nodes[id];
+  remap[node.index] = table.size();
+  table.push_back(descriptors[node.index]);
+  if (node.end != node.index) {
+    for (uint32_t child : node.children) {
+      emit(child, table, remap);
+    }
+    remap[node.end] = table.size();
+    table.push_back(descriptors[node.end]);
+  }
+}
+
+int Wad::commitBatch()
+{
+  std::unique_lock<WadLock> guard(lock);
+  if (!batching) {
+    return 0;
+  }
+  batching = false;
+
+  /* Where each directory's new entries go: over its free slots, if any. */
+  std::vector<std::pair<uint32_t, uint32_t>> groups;
+  for (uint32_t parent : batch_parents) {
+    uint32_t at = parent ? nodes[parent].end : batch_base;
+    while (at > 0 && is_blank(&descriptors[at - 1])) {
+      --at;
+    }
+    groups.emplace_back(at, parent);
+  }
+  std::sort(groups.begin(), groups.end());
+
+  std::vector<WadDescriptor> table;
+  std::vector<uint32_t> remap(descriptors.size(), WAD_NONE);
+  table.reserve(descriptors.size());
+  auto group = groups.begin();
+  for (uint32_t pos = 0; pos <= batch_base; ++pos) {
+    for (; group != groups.end() && group->first == pos; ++group) {
+      uint32_t parent = group->second;
+      uint32_t end = parent ? nodes[parent].end : batch_base;
+      uint32_t count = table.size();
+      for (uint32_t child : nodes[parent].children) {
+        if (nodes[child].index >= batch_base) {
+          emit(child, table, remap);
+        }
+      }
+      count = table.size() - count;
+      if (count < end - pos) {
+        pos += count;
+      } else {
+        if (count > end - pos && (flags & WAD_SLACK)) {
+          table.resize(table.size() + SLACK_SLOTS);
+        }
+        pos = end;
+      }
+    }
+    if (pos < batch_base) {
+      remap[pos] = table.size();
+      table.push_back(descriptors[pos]);
+    }
+  }
+
+  for (auto node = nodes.begin() + 1; node != nodes.end(); ++node) {
+    node->index = remap[node->index];
+    node->end = remap[node->end];
   }
-  if (create_name && !*s && (
-      desc == descriptors.data() + descriptors.size() || is_end(desc->name))) {
-    memcpy(create_name, component, 8);
-    return desc;
+  uint32_t from = groups.empty() ? WAD_NONE : groups.front().first;
+  if (batch_from < batch_base) {
+    from = std::min(from, remap[batch_from]);
   }
-  return nullptr;
+  descriptors.swap(table);
+  if (from != WAD_NONE) {
+    update(from, descriptors.size());
+  }
+  return 0;
+}
+
+WadDescriptor *Wad::descriptor(uint32_t id)
+{
+  return id ? table() + nodes[id].index : WAD_ROOT;
 }
 
-Wad *Wad::loadWad(const std::string& path)
+WadDescriptor *Wad::resolve(uint32_t id)
+{
+  return id < nodes.size() ? descriptor(id) : nullptr;
+}
+
+Wad *Wad::loadWad(const std::string& path, int flags)
 {
   int fd = open(path.c_str(), O_RDWR);
   if (fd < 0) {
@@ -126,10 +535,42 @@ Wad *Wad::loadWad(const std::string& path)
   pread(fd, &header, sizeof(WadHeader), 0);
   std::unique_ptr<Wad> wad(new Wad());
   wad->fd = fd;
+  wad->flags = flags;
   memcpy(wad->magic, header.magic, sizeof(header.magic));
+  wad->compressed = !memcmp(header.magic, "ZWAD", 4);
   wad->doffset = header.doffset;
-  wad->descriptors.resize(header.dcount);
-  pread(fd, wad->descriptors.data(), header.dcount * sizeof(WadDescriptor), header.doffset);
+  wad->nodes.push_back({ WAD_NONE, WAD_NONE, WAD_NONE, {}, false });
+  wad->paths.emplace("/", 0);
+  /* The table can only be used in place if it is aligned for
+   * WadDescriptor; nothing requires that, so others are read in. */
+  if ((flags & WAD_LAZY) && !(flags & WAD_OVERWRITE) && header.doffset % alignof(WadDescriptor) == 0) {
+    off_t start = header.doffset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t size = header.doffset - start + (size_t)header.dcount * sizeof(WadDescriptor);
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, start);
+    if (addr != MAP_FAILED) {
+      wad->lazy_map = addr;
+      wad->lazy_map_size = size;
+      wad->lazy_table = reinterpret_cast<WadDescriptor *>(static_cast<char *>(addr) + (header.doffset - start));
+      wad->lazy_count = header.dcount;
+    }
+  }
+  if (!wad->lazy_table) {
+    wad->descriptors.resize(header.dcount);
+    pread(fd, wad->descriptors.data(), header.dcount * sizeof(WadDescriptor), header.doffset);
+    wad->build_index(0, "", true);
+    wad->find_data_end();
+    wad->count_shares();
+  }
+  if (flags & WAD_OVERWRITE) {
+    wad->build_free_map();
+  }
+  if (flags & WAD_MMAP) {
+    wad->map_file();
+  }
+  if (flags & WAD_CHECKSUM) {
+    wad->checksum_path = path + ".crc";
+    wad->read_checksums();
+  }
 
   return wad.release();
 }
@@ -141,104 +582,2424 @@ std::string Wad::getMagic()
 
 bool Wad::isContent(const std::string& path)
 {
-  return is_file(resolve(path));
+  return isContent(getNode(path));
 }
 
 bool Wad::isDirectory(const std::string& path)
 {
-  return is_dir(resolve(path));
+  return isDirectory(getNode(path));
 }
 
 int Wad::getSize(const std::string& path)
 {
-  WadDescriptor *desc = resolve(path);
-  return is_file(desc) ? desc->size : -1;
+  return getSize(getNode(path));
 }
 
 int Wad::getContents(const std::string& path, char *buffer, int length, int offset)
 {
-  WadDescriptor *desc = resolve(path);
+  return getContents(getNode(path), buffer, length, offset);
+}
+
+/*
+ * Node ids work as handles: they stay valid for the life of the Wad, so a
+ * caller that resolves a path (or walks the tree one name at a time) can
+ * keep using the id without the path being looked up again. The path
+ * versions above are just getNode() followed by these.
+ */
+
+uint32_t Wad::getNode(const std::string& path)
+{
+  {
+    std::shared_lock<WadLock> guard(lock);
+    uint32_t id = lookup(path);
+    if (id != WAD_NONE || !lazy_table) {
+      return id;
+    }
+  }
+  std::unique_lock<WadLock> guard(lock);
+  return load_path(path);
+}
+
+uint32_t Wad::getChild(uint32_t node, const std::string& name)
+{
+  std::shared_lock<WadLock> guard = lock_listed(node);
+  if (!is_dir(resolve(node))) {
+    return WAD_NONE;
+  }
+  for (uint32_t child : nodes[node].children) {
+    if (entry_name(descriptor(child)) == name) {
+      return child;
+    }
+  }
+  return WAD_NONE;
+}
+
+std::string Wad::getPath(uint32_t node)
+{
+  std::shared_lock<WadLock> guard(lock);
+  return node < nodes.size() ? node_path(node) : std::string();
+}
+
+/* WAD_NONE for the root. */
+uint32_t Wad::getParent(uint32_t node)
+{
+  std::shared_lock<WadLock> guard(lock);
+  return node < nodes.size() ? nodes[node].parent : WAD_NONE;
+}
+
+int Wad::getChildren(uint32_t node, std::vector<uint32_t> *children)
+{
+  std::shared_lock<WadLock> guard = lock_listed(node);
+  if (!is_dir(resolve(node))) {
+    return -1;
+  }
+  children->insert(children->end(), nodes[node].children.begin(), nodes[node].children.end());
+  return nodes[node].children.size();
+}
+
+bool Wad::isContent(uint32_t node)
+{
+  std::shared_lock<WadLock> guard(lock);
+  return is_file(resolve(node));
+}
+
+bool Wad::isDirectory(uint32_t node)
+{
+  std::shared_lock<WadLock> guard(lock);
+  return is_dir(resolve(node));
+}
+
+int Wad::getSize(uint32_t node)
+{
+  std::shared_lock<WadLock> guard(lock);
+  WadDescriptor *desc = resolve(node);
+  return is_file(desc) ? lump_size(node, desc) : -1;
+}
+
+int Wad::getContents(uint32_t node, char *buffer, int length, int offset)
+{
+  std::shared_lock<WadLock> guard(lock);
+  WadDescriptor *desc = resolve(node);
   if (!is_file(desc)) {
     return -1;
   }
+  if (compressed) {
+    return read_compressed(node, desc, buffer, length, offset);
+  }
   if (offset >= (int)desc->size) {
     return 0;
   }
   if (length > (int)desc->size - offset) {
     length = (int)desc->size - offset;
   }
+  if (mapping && (size_t)desc->offset + desc->size <= mapping_size) {
+    memcpy(buffer, mapping + desc->offset + offset, length);
+    return length;
+  }
+  if (cache.enabled() && cache.fits(desc->size)) {
+    if (cache.get(node, buffer, length, offset)) {
+      return length;
+    }
+    uint64_t ticket = cache.ticket();
+    std::string data(desc->size, 0);
+    if (pread(fd, data.data(), data.size(), desc->offset) != (ssize_t)data.size()) {
+      return -1;
+    }
+    memcpy(buffer, data.data() + offset, length);
+    cache.put(node, std::move(data), ticket);
+    return length;
+  }
   return pread(fd, buffer, length, desc->offset + offset);
 }
 
-int Wad::getDirectory(const std::string& path, std::vector<std::string> *directory)
+#define RING_ENTRIES 64
+#define DRAIN_RETRIES 100 /* a millisecond apart */
+
+/*
+ * Reads many lumps at once. The reads are sorted by where they are in
+ * the file, reads that pick up exactly where the previous one left off
+ * are merged into one vectored read, and the lot is handed to io_uring
+ * (or done with preadv if that is not available). Returns 0, or -1 if
+ * any read failed; see each result.
+ */
+int Wad::getContentsBatch(WadRead *reads, size_t count)
 {
-  WadDescriptor *desc = resolve(path);
-  if (!desc) {
-    return -1;
+  std::shared_lock<WadLock> guard(lock);
+  std::vector<std::pair<uint64_t, uint32_t>> spans;
+  int ret = 0;
+  for (size_t i = 0; i < count; ++i) {
+    WadRead& read = reads[i];
+    WadDescriptor *desc = resolve(read.node);
+    if (!is_file(desc) || read.offset < 0 || read.length < 0) {
+      read.result = -1;
+      ret = -1;
+      continue;
+    }
+    if (compressed) {
+      read.result = read_compressed(read.node, desc, read.buffer, read.length, read.offset);
+      ret = read.result < 0 ? -1 : ret;
+      continue;
+    }
+    read.result = read.offset >= (int)desc->size ? 0 : std::min(read.length, (int)desc->size - read.offset);
+    if (!read.result) {
+      continue;
+    }
+    if (mapping && (size_t)desc->offset + desc->size <= mapping_size) {
+      memcpy(read.buffer, mapping + desc->offset + read.offset, read.result);
+      continue;
+    }
+    spans.emplace_back((uint64_t)desc->offset + read.offset, i);
   }
-  int count = 0;
-  WAD_ITER(desc, {
-    size_t namelen = strnlen(desc->name, sizeof(desc->name));
-    if (is_start(desc->name)) {
-      namelen -= 6;
+  std::sort(spans.begin(), spans.end());
+
+  struct Group
+  {
+    uint64_t pos;
+    size_t first;
+    size_t count;
+    size_t size;
+  };
+  std::vector<Group> groups;
+  std::vector<struct iovec> iovs;
+  for (auto& span : spans) {
+    WadRead& read = reads[span.second];
+    Group *last = groups.empty() ? nullptr : &groups.back();
+    if (!last || last->pos + last->size != span.first || last->count == IOV_MAX) {
+      groups.push_back({ span.first, iovs.size(), 0, 0 });
+      last = &groups.back();
     }
-    directory->emplace_back(desc->name, namelen);
-    ++count;
-  }) else {
-    return -1;
+    iovs.push_back({ read.buffer, (size_t)read.result });
+    ++last->count;
+    last->size += read.result;
   }
-  return count;
+
+  /* Hand out what a group read got; finish short reads one by one. */
+  auto finish = [&](Group& group, ssize_t n) {
+    for (size_t k = 0; k < group.count; ++k) {
+      WadRead& read = reads[spans[group.first + k].second];
+      size_t len = iovs[group.first + k].iov_len;
+      size_t got = n < 0 ? 0 : std::min<size_t>(n, len);
+      n = n < 0 ? n : n - got;
+      if (got < len) {
+        ssize_t rest = pread(fd, read.buffer + got, len - got, spans[group.first + k].first + got);
+        if (rest != (ssize_t)(len - got)) {
+          read.result = -1;
+          ret = -1;
+        }
+      }
+    }
+  };
+
+  std::lock_guard<std::mutex> ring_guard(ring.lock);
+  if (!ring.ready()) {
+    for (Group& group : groups) {
+      finish(group, preadv(fd, &iovs[group.first], group.count, group.pos));
+    }
+    return ret;
+  }
+  size_t next = 0;
+  size_t pending = 0;
+  std::vector<bool> done(groups.size());
+  uint64_t g;
+  int res;
+  while (next < groups.size() || pending) {
+    io_uring_sqe *sqe;
+    while (next < groups.size() && (sqe = ring.next())) {
+      Group& group = groups[next];
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = fd;
+      sqe->off = group.pos;
+      sqe->addr = (uint64_t)&iovs[group.first];
+      sqe->len = group.count;
+      sqe->user_data = next++;
+      ++pending;
+    }
+    if (ring.submit(1) < 0) {
+      /* Take back what the kernel has not picked up, wait for what it
+       * has (it still owns those buffers), then do the rest directly. */
+      pending -= ring.withdraw();
+      while (pending) {
+        while (pending && ring.reap(&g, &res)) {
+          finish(groups[g], res);
+          done[g] = true;
+          --pending;
+        }
+        if (pending && ring.submit(1) < 0) {
+          std::this_thread::yield();
+        }
+      }
+      for (size_t i = 0; i < groups.size(); ++i) {
+        if (!done[i]) {
+          finish(groups[i], preadv(fd, &iovs[groups[i].first], groups[i].count, groups[i].pos));
+        }
+      }
+      return ret;
+    }
+    while (ring.reap(&g, &res)) {
+      finish(groups[g], res);
+      done[g] = true;
+      --pending;
+    }
+  }
+  return ret;
 }
 
-void Wad::createDirectory(const std::string& path)
+/*
+ * Asynchronous reads and writes go through their own io_uring, so they
+ * can be left in flight while the caller gets on with something else.
+ * Callbacks never run inside the call that starts the request: they run
+ * from runCompletions(), which an event loop calls whenever the fd from
+ * getCompletionFd() becomes readable. A request that cannot go through
+ * the ring (no io_uring, or too much already in flight) is done on the
+ * spot and only its callback is deferred.
+ *
+ * The Wad lock is only held while a request is set up, not while it is
+ * in flight. A write makes room and updates the table right away; until
+ * its callback runs, readers of the range being written may see the old
+ * bytes, and the lump is kept out of the cache. Anything that moves or
+ * frees lump data (compact, dedup, a write that relocates a lump) first
+ * waits for the requests in flight, so none of them is left reading or
+ * writing an extent that has been given to something else.
+ */
+
+bool Wad::async_ready()
 {
-  size_t namelen;
-  WadDescriptor start {};
-  WadDescriptor *desc = resolve(path, start.name);
-  if (!desc || (namelen = strnlen(start.name, sizeof(start.name))) > 2) {
+  if (!async_setup) {
+    async_setup = true;
+    async_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (async_fd >= 0 && async_ring.ready()) {
+      async_ring.notify(async_fd);
+    }
+  }
+  return async_ring.ready();
+}
+
+void Wad::complete_async(WadCallback done, int result)
+{
+  async_done.emplace_back(std::move(done), result);
+  uint64_t one = 1;
+  if (async_fd >= 0) {
+    write(async_fd, &one, sizeof(one));
+  }
+}
+
+/* Moves the requests the ring has finished to done. Called with
+ * async_ring.lock held. */
+void Wad::reap_async(std::vector<std::pair<WadCallback, int>>& done)
+{
+  uint64_t id;
+  int res;
+  while (async_ring.ready() && async_ring.reap(&id, &res)) {
+    auto it = async_pending.find(id);
+    WadPending& pending = it->second;
+    if (res == -EINVAL || res == -EOPNOTSUPP) {
+      /* IORING_OP_READ/WRITE need Linux 5.6. */
+      res = pending.write
+          ? pwrite(fd, pending.buffer, pending.length, pending.pos)
+          : pread(fd, pending.buffer, pending.length, pending.pos);
+    }
+    done.emplace_back(std::move(pending.done), res < 0 ? -1 : res);
+    async_pending.erase(it);
+  }
+}
+
+/* Waits for everything in the ring; the callbacks still run from
+ * runCompletions(). False if the kernel would not let us wait, in which
+ * case some requests may still be in flight and the caller must not move
+ * or free lump data. Called with async_ring.lock held. */
+bool Wad::drain_async()
+{
+  int failures = 0;
+  while (reap_async(async_done), !async_pending.empty()) {
+    if (async_ring.submit(1) >= 0) {
+      failures = 0;
+    } else if (++failures == DRAIN_RETRIES) {
+      return false;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  return true;
+}
+
+/* Gives up on the requests in flight: their callbacks get -1. Only for
+ * the destructor, which closes the ring (cancelling them) right after.
+ * Called with async_ring.lock held. */
+void Wad::fail_async()
+{
+  for (auto& [id, pending] : async_pending) {
+    async_done.emplace_back(std::move(pending.done), -1);
+  }
+  async_pending.clear();
+}
+
+void Wad::submit_async(WadPending pending)
+{
+  io_uring_sqe *sqe;
+  if (async_ready() && async_pending.size() < RING_ENTRIES && (sqe = async_ring.next())) {
+    sqe->opcode = pending.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = pending.pos;
+    sqe->addr = (uint64_t)pending.buffer;
+    sqe->len = pending.length;
+    sqe->user_data = async_next;
+    async_pending.emplace(async_next++, std::move(pending));
+    async_ring.submit(0);
     return;
   }
-  WadDescriptor end = start;
-  memcpy(start.name + namelen, "_START", 6);
-  memcpy(end.name + namelen, "_END", 4);
-  uint32_t index = desc - descriptors.data();
-  descriptors.insert(descriptors.begin() + index, { start, end });
-  uint32_t dcount = descriptors.size();
-  pwrite(fd, &dcount, 4, 4);
-  pwrite(fd, descriptors.data() + index, (dcount - index) * sizeof(WadDescriptor), doffset + index * sizeof(WadDescriptor));
+  ssize_t res = pending.write
+      ? pwrite(fd, pending.buffer, pending.length, pending.pos)
+      : pread(fd, pending.buffer, pending.length, pending.pos);
+  complete_async(std::move(pending.done), res < 0 ? -1 : res);
 }
 
-void Wad::createFile(const std::string& path)
+void Wad::getContentsAsync(uint32_t node, char *buffer, int length, int offset, WadCallback done)
 {
-  WadDescriptor file {};
-  WadDescriptor *desc = resolve(path, file.name);
-  if (!desc || is_start(file.name) || is_map(file.name) || is_end(file.name)) {
+  std::shared_lock<WadLock> guard(lock);
+  std::lock_guard<std::mutex> ring_guard(async_ring.lock);
+  WadDescriptor *desc = resolve(node);
+  if (!is_file(desc) || offset < 0 || length < 0) {
+    complete_async(std::move(done), -1);
+    return;
+  }
+  if (compressed) {
+    complete_async(std::move(done), read_compressed(node, desc, buffer, length, offset));
     return;
   }
-  uint32_t index = desc - descriptors.data();
-  descriptors.insert(descriptors.begin() + index, file);
-  uint32_t dcount = descriptors.size();
-  pwrite(fd, &dcount, 4, 4);
-  pwrite(fd, descriptors.data() + index, (dcount - index) * sizeof(WadDescriptor), doffset + index * sizeof(WadDescriptor));
+  if (offset >= (int)desc->size || !length) {
+    complete_async(std::move(done), 0);
+    return;
+  }
+  length = std::min(length, (int)desc->size - offset);
+  if (mapping && (size_t)desc->offset + desc->size <= mapping_size) {
+    memcpy(buffer, mapping + desc->offset + offset, length);
+    complete_async(std::move(done), length);
+    return;
+  }
+  submit_async({ std::move(done), buffer, length, (uint64_t)desc->offset + offset, false });
 }
 
-int Wad::writeToFile(const std::string& path, const char *buffer, int length, int offset)
+void Wad::writeToFileAsync(uint32_t node, const char *buffer, int length, int offset, WadCallback done)
 {
-  WadDescriptor *desc = resolve(path);
-  if (!is_file(desc)) {
-    return -1;
+  std::unique_lock<WadLock> guard(lock);
+  std::lock_guard<std::mutex> ring_guard(async_ring.lock);
+  if (compressed) {
+    complete_async(std::move(done), write_compressed(node, buffer, length, offset));
+    return;
   }
-  if ((uint32_t)offset != desc->size) {
-    return 0;
-  } else if (!desc->size) {
-    desc->offset = doffset;
-  } else if (desc->offset + desc->size != doffset) {
-    return 0;
+  uint32_t pos;
+  WadDescriptor old;
+  bool shared;
+  int res = reserve(node, length, offset, &pos, &old, &shared);
+  if (res <= 0) {
+    complete_async(std::move(done), res);
+    return;
   }
-  doffset += length;
-  desc->size += length;
-  pwrite(fd, &doffset, 4, 8);
-  pwrite(fd, buffer, length, doffset - length);
-  pwrite(fd, descriptors.data(), descriptors.size() * sizeof(WadDescriptor), doffset);
-  return length;
+  if (flags & WAD_CHECKSUM) {
+    sum_write(node, old, shared, buffer, res, offset);
+  }
+  cache.pin(node);
+  WadCallback unpin = [this, node, done = std::move(done)](int result) {
+    cache.unpin(node);
+    done(result);
+  };
+  submit_async({ std::move(unpin), const_cast<char *>(buffer), res, pos, true });
+}
+
+/* -1 if there is no eventfd; runCompletions() can still be polled. */
+int Wad::getCompletionFd()
+{
+  std::lock_guard<std::mutex> guard(async_ring.lock);
+  async_ready();
+  return async_fd;
+}
+
+/* Runs the callbacks of finished requests, without blocking, and returns
+ * how many ran. Callbacks run with no locks held, so they can start new
+ * requests. */
+int Wad::runCompletions()
+{
+  std::vector<std::pair<WadCallback, int>> done;
+  {
+    std::lock_guard<std::mutex> guard(async_ring.lock);
+    uint64_t count;
+    if (async_fd >= 0) {
+      read(async_fd, &count, sizeof(count));
+    }
+    done.swap(async_done);
+    reap_async(done);
+  }
+  for (auto& [callback, result] : done) {
+    callback(result);
+  }
+  return done.size();
+}
+
+/* Where a lump lives in the file, for callers that want to splice or copy
+ * it straight from the fd. Returns the size, or -1. The extent is good
+ * until the next write to the lump, compact or dedup. */
+int Wad::getExtent(uint32_t node, int *fd, uint32_t *offset)
+{
+  std::shared_lock<WadLock> guard(lock);
+  WadDescriptor *desc = resolve(node);
+  if (!is_file(desc) || compressed) {
+    return -1;
+  }
+  *fd = this->fd;
+  *offset = desc->offset;
+  return desc->size;
+}
+
+/* Only available with WAD_MMAP. The view points into the mapping and is
+ * invalidated by the next writeToFile. A null view means failure. */
+std::string_view Wad::getContentsView(const std::string& path)
+{
+  uint32_t node = getNode(path);
+  std::shared_lock<WadLock> guard(lock);
+  WadDescriptor *desc = resolve(node);
+  if (!is_file(desc) || compressed || !mapping || (size_t)desc->offset + desc->size > mapping_size) {
+    return {};
+  }
+  return std::string_view(mapping + desc->offset, desc->size);
+}
+
+int Wad::getDirectory(const std::string& path, std::vector<std::string> *directory)
+{
+  return getDirectory(getNode(path), directory);
+}
+
+int Wad::getDirectory(uint32_t node, std::vector<std::string> *directory)
+{
+  std::shared_lock<WadLock> guard = lock_listed(node);
+  if (!is_dir(resolve(node))) {
+    return -1;
+  }
+  for (uint32_t child : nodes[node].children) {
+    directory->push_back(entry_name(descriptor(child)));
+  }
+  return nodes[node].children.size();
+}
+
+/* getDirectory plus what a stat of each entry would say, in one go. */
+int Wad::listDirectory(const std::string& path, std::vector<WadEntry> *entries)
+{
+  return listDirectory(getNode(path), entries);
+}
+
+int Wad::listDirectory(uint32_t node, std::vector<WadEntry> *entries)
+{
+  std::shared_lock<WadLock> guard = lock_listed(node);
+  if (!is_dir(resolve(node))) {
+    return -1;
+  }
+  for (uint32_t child : nodes[node].children) {
+    WadDescriptor *desc = descriptor(child);
+    bool dir = is_dir(desc);
+    entries->push_back({ entry_name(desc), child, dir, dir ? 0 : lump_size(child, desc) });
+  }
+  return nodes[node].children.size();
+}
+
+void Wad::createDirectory(const std::string& path)
+{
+  std::unique_lock<WadLock> guard(lock);
+  materialize();
+  size_t namelen;
+  std::string key;
+  WadDescriptor start {};
+  uint32_t parent = lookup_parent(path, start.name, key);
+  if (parent == WAD_NONE || (namelen = strnlen(start.name, sizeof(start.name))) > 2) {
+    return;
+  }
+  WadDescriptor end = start;
+  memcpy(start.name + namelen, "_START", 6);
+  memcpy(end.name + namelen, "_END", 4);
+  WadDescriptor descs[2] = { start, end };
+  uint32_t index = insert(parent, descs, 2);
+  add_node(parent, index, index + 1, key);
+}
+
+void Wad::createFile(const std::string& path)
+{
+  std::unique_lock<WadLock> guard(lock);
+  materialize();
+  std::string key;
+  WadDescriptor file {};
+  uint32_t parent = lookup_parent(path, file.name, key);
+  if (parent == WAD_NONE || is_start(file.name) || is_map(file.name) || is_end(file.name)) {
+    return;
+  }
+  uint32_t index = insert(parent, &file, 1);
+  add_node(parent, index, index, key);
+}
+
+/*
+ * Lump data lives below dend. Without WAD_OVERWRITE, only appends to the
+ * lump that ends there are supported, as the original format intended.
+ * With it, writes can go anywhere: a lump that has to grow does so in
+ * place if it is last or the space after it is free, and otherwise moves
+ * to the best-fitting free extent (or the end of the data), leaving its
+ * old extent free for reuse.
+ *
+ * Whenever the data runs into the descriptor table, the table moves past
+ * it. With WAD_SLACK it moves past a gap twice as big as the last one
+ * (at least 4 KiB), so that most appends write only data and their own
+ * descriptor.
+ */
+int Wad::writeToFile(const std::string& path, const char *buffer, int length, int offset)
+{
+  return writeToFile(getNode(path), buffer, length, offset);
+}
+
+int Wad::writeToFile(uint32_t node, const char *buffer, int length, int offset)
+{
+  std::unique_lock<WadLock> guard(lock);
+  std::lock_guard<std::mutex> ring_guard(async_ring.lock);
+  if (compressed) {
+    return write_compressed(node, buffer, length, offset);
+  }
+  uint32_t pos;
+  WadDescriptor old;
+  bool shared;
+  int res = reserve(node, length, offset, &pos, &old, &shared);
+  if (res > 0 && pwrite(fd, buffer, res, pos) != res) {
+    return -1;
+  }
+  if (res > 0 && (flags & WAD_CHECKSUM)) {
+    sum_write(node, old, shared, buffer, res, offset);
+  }
+  return res;
+}
+
+/* All of a write but the data itself: make room for it and update the
+ * table. Returns what writeToFile will, where the data goes, the lump's
+ * descriptor from before and whether other lumps shared its extent.
+ * Called with async_ring.lock held. */
+int Wad::reserve(uint32_t node, int length, int offset, uint32_t *pos, WadDescriptor *old, bool *shared)
+{
+  materialize();
+  WadDescriptor *desc = resolve(node);
+  if (!is_file(desc)) {
+    return -1;
+  }
+  *old = *desc;
+  *shared = desc->size && shares.count(desc->offset);
+  changed(node);
+  uint32_t size = desc->size;
+  uint32_t end = offset + length;
+  bool last = size && desc->offset + size == dend;
+  if (offset < 0 || length < 0
+      || (!(flags & WAD_OVERWRITE) && ((uint32_t)offset != size || (size && !last)))) {
+    return 0;
+  }
+  if (size && shares.count(desc->offset)) {
+    if (!drain_async()) {
+      return -1;
+    }
+    uint32_t from = desc->offset;
+    desc->offset = allocate(size);
+    copy(from, desc->offset, size);
+    unref(from, size);
+    last = desc->offset + size == dend;
+  }
+  if (end > size) {
+    if (!size) {
+      desc->offset = allocate(end);
+    } else if (last) {
+      dend = desc->offset + end;
+    } else if (!free_map.extend(desc->offset + size, end - size)) {
+      if (!drain_async()) {
+        return -1;
+      }
+      uint32_t from = desc->offset;
+      desc->offset = allocate(end);
+      copy(from, desc->offset, std::min<uint32_t>(offset, size));
+      unref(from, size);
+    }
+    if ((uint32_t)offset > size) {
+      std::vector<char> zeros(offset - size);
+      pwrite(fd, zeros.data(), zeros.size(), desc->offset + size);
+    }
+    desc->size = end;
+  }
+  *pos = desc->offset + offset;
+  settle(desc);
+  return length;
+}
+
+/* Write out desc after a change to its lump, moving the table past the
+ * data first if the data has run into it. */
+void Wad::settle(WadDescriptor *desc)
+{
+  if (dend > doffset) {
+    if (flags & WAD_SLACK) {
+      slack = std::max<uint32_t>(slack * 2, 4096);
+      doffset = dend + slack;
+    } else {
+      doffset = dend;
+    }
+    update(0, descriptors.size());
+  } else {
+    uint32_t index = desc - descriptors.data();
+    update(index, index + 1);
+  }
+  if (flags & WAD_MMAP) {
+    map_file();
+  }
+}
+
+/*
+ * ZWAD lumps. The stored form of a lump is its chunks, one after the
+ * other, then a trailer:
+ *
+ *   uint32_t chunks[count + 1]  start of each chunk, then of the trailer
+ *   uint32_t raw_size
+ *   uint32_t chunk_size
+ *   uint32_t count
+ *
+ * Every chunk but the last holds chunk_size bytes of contents. A chunk
+ * that is stored smaller than that is compressed; one that did not get
+ * any smaller is stored as is. An empty lump stores nothing at all.
+ *
+ * The codec is LZ4's block format: a token with the literal and match
+ * lengths, the literals, then a 16-bit offset back into the output. It
+ * is not the fastest or the tightest, but it decompresses in one simple
+ * pass with no state.
+ */
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16) /* worst case for n bytes */
+
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_length(std::string& out, size_t len)
+{
+  for (; len >= 255; len -= 255) {
+    out += (char)255;
+  }
+  out += (char)len;
+}
+
+static void put_sequence(std::string& out, const unsigned char *literals, size_t nlit, size_t offset, size_t mlen)
+{
+  size_t extra = mlen ? mlen - LZ_MIN_MATCH : 0;
+  out += (char)((std::min<size_t>(nlit, 15) << 4) | std::min<size_t>(extra, 15));
+  if (nlit >= 15) {
+    put_length(out, nlit - 15);
+  }
+  out.append(reinterpret_cast<const char *>(literals), nlit);
+  if (mlen) {
+    out += (char)(offset & 0xff);
+    out += (char)(offset >> 8);
+    if (extra >= 15) {
+      put_length(out, extra - 15);
+    }
+  }
+}
+
+static void lz_compress(const unsigned char *src, size_t size, std::string& out)
+{
+  uint32_t table[1 << LZ_HASH_BITS] = {};
+  size_t anchor = 0;
+  size_t i = 1;
+  while (size >= LZ_MATCH_LIMIT && i + LZ_MATCH_LIMIT <= size) {
+    uint32_t seq = read32(src + i);
+    uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t ref = table[hash];
+    table[hash] = i;
+    if (i - ref > 65535 || read32(src + ref) != seq) {
+      ++i;
+      continue;
+    }
+    size_t mlen = LZ_MIN_MATCH;
+    while (i + mlen < size - LZ_LAST_LITERALS && src[ref + mlen] == src[i + mlen]) {
+      ++mlen;
+    }
+    put_sequence(out, src + anchor, i - anchor, i - ref, mlen);
+    i += mlen;
+    anchor = i;
+  }
+  put_sequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+/* Returns the decompressed size, or -1 if src is not valid. */
+static int lz_decompress(const unsigned char *src, size_t size, char *dst, size_t capacity)
+{
+  const unsigned char *ip = src;
+  const unsigned char *end = src + size;
+  size_t op = 0;
+  while (ip < end) {
+    unsigned token = *ip++;
+    size_t nlit = token >> 4;
+    if (nlit == 15) {
+      unsigned char b;
+      do {
+        if (ip == end) {
+          return -1;
+        }
+        nlit += b = *ip++;
+      } while (b == 255);
+    }
+    if (nlit > (size_t)(end - ip) || nlit > capacity - op) {
+      return -1;
+    }
+    memcpy(dst + op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == end) {
+      break;
+    }
+    if (end - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15) {
+      unsigned char b;
+      do {
+        if (ip == end) {
+          return -1;
+        }
+        mlen += b = *ip++;
+      } while (b == 255);
+    }
+    mlen += LZ_MIN_MATCH;
+    if (!offset || offset > op || mlen > capacity - op) {
+      return -1;
+    }
+    for (size_t k = 0; k < mlen; ++k, ++op) {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return op;
+}
+
+std::string wadEncode(const char *data, uint32_t size)
+{
+  std::string out;
+  if (!size) {
+    return out;
+  }
+  uint32_t count = (size + WAD_CHUNK_SIZE - 1) / WAD_CHUNK_SIZE;
+  std::vector<uint32_t> trailer;
+  std::string chunk;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t len = std::min<uint32_t>(WAD_CHUNK_SIZE, size - i * WAD_CHUNK_SIZE);
+    const char *raw = data + (size_t)i * WAD_CHUNK_SIZE;
+    chunk.clear();
+    lz_compress(reinterpret_cast<const unsigned char *>(raw), len, chunk);
+    trailer.push_back(out.size());
+    if (chunk.size() < len) {
+      out += chunk;
+    } else {
+      out.append(raw, len);
+    }
+  }
+  trailer.push_back(out.size());
+  trailer.push_back(size);
+  trailer.push_back(WAD_CHUNK_SIZE);
+  trailer.push_back(count);
+  out.append(reinterpret_cast<const char *>(trailer.data()), trailer.size() * sizeof(uint32_t));
+  return out;
+}
+
+/* Frames are read on first use and kept until the lump is written. */
+bool Wad::read_frame(uint32_t node, const WadDescriptor *desc, WadFrame& frame)
+{
+  std::lock_guard<std::mutex> guard(frame_lock);
+  auto it = frames.find(node);
+  if (it != frames.end()) {
+    frame = it->second;
+    return true;
+  }
+  frame = { 0, WAD_CHUNK_SIZE, { 0 } };
+  if (desc->size) {
+    uint32_t tail[3];
+    if (desc->size < sizeof(tail) + 2 * sizeof(uint32_t)
+        || pread(fd, tail, sizeof(tail), desc->offset + desc->size - sizeof(tail)) != sizeof(tail)) {
+      return false;
+    }
+    uint32_t count = tail[2];
+    uint64_t table_size = ((uint64_t)count + 1) * sizeof(uint32_t);
+    if (!tail[1] || tail[1] > WAD_CHUNK_SIZE || !count || table_size + sizeof(tail) > desc->size
+        || (tail[0] + (uint64_t)tail[1] - 1) / tail[1] != count) {
+      return false;
+    }
+    uint32_t start = desc->size - sizeof(tail) - table_size;
+    frame = { tail[0], tail[1], std::vector<uint32_t>(count + 1) };
+    if (pread(fd, frame.chunks.data(), table_size, desc->offset + start) != (ssize_t)table_size
+        || frame.chunks[0] || frame.chunks[count] != start
+        || !std::is_sorted(frame.chunks.begin(), frame.chunks.end())) {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      if (frame.chunks[i + 1] - frame.chunks[i] > LZ_BOUND(WAD_CHUNK_SIZE)) {
+        return false;
+      }
+    }
+  }
+  frames.emplace(node, frame);
+  return true;
+}
+
+uint32_t Wad::lump_size(uint32_t node, const WadDescriptor *desc)
+{
+  WadFrame frame;
+  if (!compressed) {
+    return desc->size;
+  }
+  return read_frame(node, desc, frame) ? frame.raw_size : 0;
+}
+
+/* Reads the stored chunks that cover the range in one go, then
+ * decompresses them one at a time. */
+int Wad::read_compressed(uint32_t node, const WadDescriptor *desc, char *buffer, int length, int offset)
+{
+  WadFrame frame;
+  if (!read_frame(node, desc, frame) || offset < 0 || length < 0) {
+    return -1;
+  }
+  if ((uint32_t)offset >= frame.raw_size || !length) {
+    return 0;
+  }
+  length = std::min<uint32_t>(length, frame.raw_size - offset);
+  uint32_t first = offset / frame.chunk_size;
+  uint32_t last = (offset + length - 1) / frame.chunk_size;
+  uint32_t base = frame.chunks[first];
+  std::vector<unsigned char> stored(frame.chunks[last + 1] - base);
+  if (pread(fd, stored.data(), stored.size(), desc->offset + base) != (ssize_t)stored.size()) {
+    return -1;
+  }
+  std::vector<char> chunk(frame.chunk_size);
+  int done = 0;
+  for (uint32_t i = first; i <= last; ++i) {
+    uint32_t raw_len = std::min<uint32_t>(frame.chunk_size, frame.raw_size - i * frame.chunk_size);
+    uint32_t stored_len = frame.chunks[i + 1] - frame.chunks[i];
+    const unsigned char *src = stored.data() + frame.chunks[i] - base;
+    const char *raw = reinterpret_cast<const char *>(src);
+    if (stored_len < raw_len) {
+      if (lz_decompress(src, stored_len, chunk.data(), raw_len) != (int)raw_len) {
+        return -1;
+      }
+      raw = chunk.data();
+    } else if (stored_len != raw_len) {
+      return -1;
+    }
+    uint32_t from = i == first ? offset - i * frame.chunk_size : 0;
+    uint32_t len = std::min<uint32_t>(raw_len - from, length - done);
+    memcpy(buffer + done, raw + from, len);
+    done += len;
+  }
+  return done;
+}
+
+/*
+ * A write to a compressed lump re-encodes all of it and stores the result
+ * at the end of the data (or where it was, if it was last there and not
+ * shared). Without WAD_OVERWRITE the old copy is left for compact() to
+ * reclaim. Writes can
+ * go anywhere in the lump, since it is rewritten anyway.
+ */
+int Wad::write_compressed(uint32_t node, const char *buffer, int length, int offset)
+{
+  materialize();
+  WadDescriptor *desc = resolve(node);
+  WadFrame frame;
+  if (!is_file(desc) || !read_frame(node, desc, frame)) {
+    return -1;
+  }
+  if (offset < 0 || length < 0) {
+    return 0;
+  }
+  if ((int64_t)offset + length > INT_MAX) {
+    return -1;
+  }
+  std::vector<char> raw(std::max<uint32_t>(frame.raw_size, offset + length));
+  if (frame.raw_size && read_compressed(node, desc, raw.data(), frame.raw_size, 0) != (int)frame.raw_size) {
+    return -1;
+  }
+  memcpy(raw.data() + offset, buffer, length);
+  std::string data = wadEncode(raw.data(), raw.size());
+  changed(node);
+  {
+    std::lock_guard<std::mutex> guard(frame_lock);
+    frames.erase(node);
+  }
+
+  uint32_t from = desc->offset;
+  uint32_t size = desc->size;
+  bool shared = size && shares.count(from);
+  if (size && from + size == dend && !shared) {
+    dend = from;
+    size = 0;
+  }
+  desc->offset = allocate(data.size());
+  desc->size = data.size();
+  if (pwrite(fd, data.data(), data.size(), desc->offset) != (ssize_t)data.size()) {
+    return -1;
+  }
+  if (flags & WAD_CHECKSUM) {
+    set_checksum(from, desc->offset, { desc->size, wadCrc32c(0, data.data(), data.size()) }, shared);
+  }
+  unref(from, size);
+  settle(desc);
+  return length;
+}
+
+/*
+ * Compaction rewrites the lumps back to back in table (directory) order
+ * right after the header, then moves the table right after them and
+ * truncates the file. A lump in the way of the next placement is first
+ * moved past the end of the data and the table.
+ *
+ * With a budget, a step stops once it has moved that many bytes and
+ * returns 1; call again to continue. Each step walks the table from the
+ * start, skipping lumps that are already in place, so the Wad can be
+ * written to between steps. Returns 0 once the file is compact.
+ */
+int Wad::compact(uint32_t budget)
+{
+  std::unique_lock<WadLock> guard(lock);
+  materialize();
+  if (batching) {
+    return -1;
+  }
+  {
+    std::lock_guard<std::mutex> ring_guard(async_ring.lock);
+    if (!drain_async()) {
+      return -1;
+    }
+  }
+  std::multimap<uint32_t, uint32_t> by_offset;
+  for (uint32_t i = 0; i < descriptors.size(); ++i) {
+    if (descriptors[i].size) {
+      by_offset.emplace(descriptors[i].offset, i);
+    }
+  }
+  /* Lumps sharing an extent move together. */
+  auto move = [&](uint32_t i, uint32_t to) {
+    uint32_t from = descriptors[i].offset;
+    auto range = by_offset.equal_range(from);
+    std::vector<uint32_t> group;
+    for (auto it = range.first; it != range.second; ++it) {
+      group.push_back(it->second);
+    }
+    by_offset.erase(range.first, range.second);
+    copy(from, to, descriptors[i].size);
+    if (flags & WAD_CHECKSUM) {
+      std::lock_guard<std::mutex> guard(checksum_lock);
+      auto sum = checksums.find(from);
+      if (sum != checksums.end()) {
+        WadChecksum moved_sum = sum->second;
+        checksums.erase(sum);
+        checksums[to] = moved_sum;
+        checksums_dirty = true;
+      }
+    }
+    for (uint32_t j : group) {
+      descriptors[j].offset = to;
+      by_offset.emplace(to, j);
+    }
+  };
+
+  /* Lumps in the way go past the table the header points at, which has
+   * to stay intact until the new one is written. */
+  uint32_t table_size = descriptors.size() * sizeof(WadDescriptor);
+  uint32_t spill = std::max(dend, doffset + table_size);
+  uint32_t pos = sizeof(WadHeader);
+  uint32_t moved = 0;
+  bool done = true;
+  for (uint32_t i = 0; i < descriptors.size(); ++i) {
+    WadDescriptor& desc = descriptors[i];
+    /* Only a shared extent can already have been placed. */
+    if (!desc.size || desc.offset < pos) {
+      continue;
+    }
+    if (desc.offset != pos) {
+      if (budget && moved >= budget) {
+        done = false;
+        break;
+      }
+      std::vector<uint32_t> in_way;
+      auto it = by_offset.lower_bound(pos);
+      for (; it != by_offset.end() && it->first < pos + desc.size; ++it) {
+        if (it->first != desc.offset && (in_way.empty() || descriptors[in_way.back()].offset != it->first)) {
+          in_way.push_back(it->second);
+        }
+      }
+      for (uint32_t other : in_way) {
+        moved += descriptors[other].size;
+        spill += descriptors[other].size;
+        move(other, spill - descriptors[other].size);
+        dend = spill;
+      }
+      moved += desc.size;
+      move(i, pos);
+    }
+    pos += desc.size;
+  }
+
+  /*
+   * The table is written here whatever the flags, so that the header
+   * never points past the end of the file or at lumps that have moved.
+   * If the new place overlaps the old one, the table goes to the end
+   * first, so that a crash never leaves a half-written table in use.
+   */
+  int ret = 0;
+  if (done) {
+    struct stat st;
+    if (!moved && doffset == pos && !fstat(fd, &st) && (uint32_t)st.st_size == pos + table_size) {
+      return 0;
+    }
+    if (doffset != pos && pos < doffset + table_size && doffset < pos + table_size) {
+      doffset = std::max(dend, doffset + table_size);
+      ret = write_table();
+    }
+    dend = doffset = pos;
+    slack = 0;
+    if (!ret && !(ret = write_table())) {
+      ftruncate(fd, doffset + table_size);
+    }
+  } else {
+    if (dend > doffset) {
+      doffset = dend;
+    }
+    ret = write_table();
+  }
+  dirty = ret != 0;
+  count_shares();
+  if (flags & WAD_CHECKSUM) {
+    std::lock_guard<std::mutex> guard(checksum_lock);
+    std::unordered_map<uint32_t, WadChecksum> live;
+    for (WadDescriptor& desc : descriptors) {
+      auto sum = checksums.find(desc.offset);
+      if (desc.size && sum != checksums.end() && sum->second.size == desc.size) {
+        live.insert(*sum);
+      }
+    }
+    checksums_dirty |= live.size() != checksums.size();
+    checksums.swap(live);
+  }
+  if (flags & WAD_OVERWRITE) {
+    free_map.clear();
+    build_free_map();
+  }
+  if (flags & WAD_MMAP) {
+    map_file();
+  }
+  return ret ? -1 : done ? 0 : 1;
+}
+
+/* Free extents are the holes between lumps, the header and the table.
+ * Anything past the end of the data is handed out from dend instead. */
+void Wad::build_free_map()
+{
+  std::vector<std::pair<uint32_t, uint32_t>> used;
+  used.emplace_back(0, sizeof(WadHeader));
+  used.emplace_back(doffset, doffset + descriptors.size() * sizeof(WadDescriptor));
+  for (WadDescriptor& desc : descriptors) {
+    if (desc.size) {
+      used.emplace_back(desc.offset, desc.offset + desc.size);
+    }
+  }
+  std::sort(used.begin(), used.end());
+  uint32_t pos = 0;
+  for (auto& extent : used) {
+    if (extent.first > pos && extent.first <= dend) {
+      free_map.add(pos, extent.first - pos);
+    }
+    pos = std::max(pos, extent.second);
+  }
+}
+
+uint32_t Wad::allocate(uint32_t size)
+{
+  uint32_t offset;
+  if ((flags & WAD_OVERWRITE) && free_map.take(size, &offset)) {
+    return offset;
+  }
+  offset = dend;
+  dend += size;
+  return offset;
+}
+
+void Wad::release(uint32_t offset, uint32_t size)
+{
+  if (size) {
+    free_map.add(offset, size);
+    free_map.trim(&dend);
+  }
+}
+
+/* Drop a lump's claim on the extent at offset, freeing it with the last. */
+void Wad::unref(uint32_t offset, uint32_t size)
+{
+  auto it = shares.find(offset);
+  if (it != shares.end()) {
+    if (--it->second < 2) {
+      shares.erase(it);
+    }
+  } else if (flags & WAD_OVERWRITE) {
+    release(offset, size);
+  } else if (size && offset + size == dend) {
+    dend = offset;
+  }
+}
+
+void Wad::count_shares()
+{
+  shares.clear();
+  for (WadDescriptor& desc : descriptors) {
+    if (desc.size) {
+      ++shares[desc.offset];
+    }
+  }
+  for (auto it = shares.begin(); it != shares.end();) {
+    it = it->second < 2 ? shares.erase(it) : std::next(it);
+  }
+}
+
+/* Forget what is known about a lump's contents before it is written. */
+void Wad::changed(uint32_t node)
+{
+  cache.erase(node);
+  auto known = content_of.find(node);
+  if (known == content_of.end()) {
+    return;
+  }
+  auto range = by_content.equal_range(known->second);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == node) {
+      by_content.erase(it);
+      break;
+    }
+  }
+  content_of.erase(known);
+}
+
+/*
+ * Deduplication. Lumps with the same stored bytes can point at a single
+ * extent; shares counts the lumps at each such extent, and a write to one
+ * of them first gives it its own copy. Lumps are found by a hash of
+ * their contents, kept per node once the first dedup() has built it, and
+ * always compared byte for byte before being shared.
+ */
+uint64_t Wad::hash_extent(uint32_t offset, uint32_t size)
+{
+  uint64_t hash = 14695981039346656037ull;
+  char buf[65536];
+  while (size) {
+    ssize_t n = pread(fd, buf, std::min<uint32_t>(size, sizeof(buf)), offset);
+    if (n <= 0) {
+      break;
+    }
+    for (ssize_t i = 0; i < n; ++i) {
+      hash = (hash ^ (unsigned char)buf[i]) * 1099511628211ull;
+    }
+    offset += n;
+    size -= n;
+  }
+  return hash;
+}
+
+bool Wad::same_extent(uint32_t a, uint32_t b, uint32_t size)
+{
+  char abuf[16384];
+  char bbuf[16384];
+  while (size) {
+    uint32_t n = std::min<uint32_t>(size, sizeof(abuf));
+    if (pread(fd, abuf, n, a) != n || pread(fd, bbuf, n, b) != n || memcmp(abuf, bbuf, n)) {
+      return false;
+    }
+    a += n;
+    b += n;
+    size -= n;
+  }
+  return true;
+}
+
+void Wad::index_contents()
+{
+  if (contents_indexed) {
+    return;
+  }
+  for (uint32_t id = 1; id < nodes.size(); ++id) {
+    WadDescriptor *desc = resolve(id);
+    if (is_file(desc) && desc->size && !content_of.count(id)) {
+      uint64_t hash = hash_extent(desc->offset, desc->size);
+      by_content.emplace(hash, id);
+      content_of.emplace(id, hash);
+    }
+  }
+  contents_indexed = true;
+}
+
+/* Point node at an identical lump's extent. Returns the bytes freed. */
+uint32_t Wad::share(uint32_t node)
+{
+  WadDescriptor *desc = resolve(node);
+  if (!is_file(desc) || !desc->size) {
+    return 0;
+  }
+  auto known = content_of.find(node);
+  uint64_t hash;
+  if (known != content_of.end()) {
+    hash = known->second;
+  } else {
+    hash = hash_extent(desc->offset, desc->size);
+    by_content.emplace(hash, node);
+    content_of.emplace(node, hash);
+  }
+  auto range = by_content.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    WadDescriptor *other = resolve(it->second);
+    if (it->second == node || other->size != desc->size || other->offset == desc->offset
+        || !same_extent(other->offset, desc->offset, desc->size)) {
+      continue;
+    }
+    uint32_t from = desc->offset;
+    bool shared = shares.count(from);
+    uint32_t& refs = shares[other->offset];
+    refs = std::max<uint32_t>(refs, 1) + 1;
+    desc->offset = other->offset;
+    if (!shared && (flags & WAD_CHECKSUM)) {
+      std::lock_guard<std::mutex> guard(checksum_lock);
+      checksums_dirty |= checksums.erase(from);
+    }
+    unref(from, desc->size);
+    settle(desc);
+    return shared ? 0 : desc->size;
+  }
+  return 0;
+}
+
+/*
+ * Share the extents of identical lumps. Returns the number of bytes no
+ * longer referenced; with WAD_OVERWRITE they are reused by later writes,
+ * otherwise compact() reclaims them. -1 if asynchronous requests in
+ * flight could not be waited for.
+ */
+int Wad::dedup()
+{
+  std::unique_lock<WadLock> guard(lock);
+  {
+    std::lock_guard<std::mutex> ring_guard(async_ring.lock);
+    if (!drain_async()) {
+      return -1;
+    }
+  }
+  materialize();
+  index_contents();
+  int freed = 0;
+  for (uint32_t id = 1; id < nodes.size(); ++id) {
+    freed += share(id);
+  }
+  return freed;
+}
+
+/* Dedup a single lump, e.g. once it has been written in full. */
+int Wad::dedup(uint32_t node)
+{
+  std::unique_lock<WadLock> guard(lock);
+  {
+    std::lock_guard<std::mutex> ring_guard(async_ring.lock);
+    if (!drain_async()) {
+      return -1;
+    }
+  }
+  materialize();
+  index_contents();
+  return share(node);
+}
+
+void Wad::copy(uint32_t from, uint32_t to, uint32_t size)
+{
+  loff_t in = from;
+  loff_t out = to;
+  while (size) {
+    ssize_t n = copy_file_range(fd, &in, fd, &out, size, 0);
+    if (n <= 0) {
+      break;
+    }
+    size -= n;
+  }
+  char buf[65536];
+  while (size) {
+    ssize_t n = pread(fd, buf, std::min<uint32_t>(size, sizeof(buf)), in);
+    if (n <= 0) {
+      return;
+    }
+    pwrite(fd, buf, n, out);
+    in += n;
+    out += n;
+    size -= n;
+  }
+}
+
+WadLock::WadLock()
+{
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&rwlock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+WadLock::~WadLock()
+{
+  pthread_rwlock_destroy(&rwlock);
+}
+
+void WadLock::lock()
+{
+  pthread_rwlock_wrlock(&rwlock);
+}
+
+bool WadLock::try_lock()
+{
+  return !pthread_rwlock_trywrlock(&rwlock);
+}
+
+void WadLock::unlock()
+{
+  pthread_rwlock_unlock(&rwlock);
+}
+
+void WadLock::lock_shared()
+{
+  pthread_rwlock_rdlock(&rwlock);
+}
+
+bool WadLock::try_lock_shared()
+{
+  return !pthread_rwlock_tryrdlock(&rwlock);
+}
+
+void WadLock::unlock_shared()
+{
+  pthread_rwlock_unlock(&rwlock);
+}
+
+void WadFreeMap::erase(std::map<uint32_t, uint32_t>::iterator it)
+{
+  by_size.erase({ it->second, it->first });
+  by_offset.erase(it);
+}
+
+void WadFreeMap::insert(uint32_t offset, uint32_t size)
+{
+  by_offset.emplace(offset, size);
+  by_size.emplace(size, offset);
+}
+
+/* Return an extent to the map, merging it with its neighbours. */
+void WadFreeMap::add(uint32_t offset, uint32_t size)
+{
+  auto next = by_offset.lower_bound(offset);
+  if (next != by_offset.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      erase(prev);
+    }
+  }
+  if (next != by_offset.end() && offset + size == next->first) {
+    size += next->second;
+    erase(next);
+  }
+  insert(offset, size);
+}
+
+/* Best fit: the smallest extent that is big enough. */
+bool WadFreeMap::take(uint32_t size, uint32_t *offset)
+{
+  auto it = by_size.lower_bound({ size, 0 });
+  if (it == by_size.end()) {
+    return false;
+  }
+  *offset = it->second;
+  uint32_t len = it->first;
+  erase(by_offset.find(*offset));
+  if (len > size) {
+    insert(*offset + size, len - size);
+  }
+  return true;
+}
+
+/* Take the first size bytes of the extent starting at offset, if any. */
+bool WadFreeMap::extend(uint32_t offset, uint32_t size)
+{
+  auto it = by_offset.find(offset);
+  if (it == by_offset.end() || it->second < size) {
+    return false;
+  }
+  uint32_t len = it->second;
+  erase(it);
+  if (len > size) {
+    insert(offset + size, len - size);
+  }
+  return true;
+}
+
+void WadFreeMap::clear()
+{
+  by_offset.clear();
+  by_size.clear();
+}
+
+/* Give back free space at the very end of the data. */
+void WadFreeMap::trim(uint32_t *end)
+{
+  while (!by_offset.empty()) {
+    auto last = std::prev(by_offset.end());
+    if (last->first + last->second != *end) {
+      return;
+    }
+    *end = last->first;
+    erase(last);
+  }
+}
+
+/*
+ * The content cache sits under getContents for reads that would otherwise
+ * be a pread (a mapping is already as good as a cache). A miss reads and
+ * keeps the whole lump, so the rest of a chunked read hits. Lumps bigger
+ * than a quarter of the cache go around it, so that one big file does
+ * not push out everything else. writeToFile drops the lump it changes;
+ * readers fill the cache under the shared Wad lock, so a write can never
+ * land between a read and its put.
+ */
+
+bool WadCache::enabled()
+{
+  return capacity;
+}
+
+bool WadCache::fits(size_t size)
+{
+  return size <= capacity / 4;
+}
+
+bool WadCache::get(uint32_t node, char *buffer, int length, int offset)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = entries.find(node);
+  if (it == entries.end()) {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  lru.splice(lru.begin(), lru, it->second);
+  memcpy(buffer, it->second->second.data() + offset, length);
+  return true;
+}
+
+/* Taken before reading a lump from the file, to be handed to put. */
+uint64_t WadCache::ticket()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return unpins;
+}
+
+void WadCache::put(uint32_t node, std::string data, uint64_t ticket)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (entries.count(node) || pinned.count(node) || ticket != unpins) {
+    return;
+  }
+  used += data.size();
+  lru.emplace_front(node, std::move(data));
+  entries.emplace(node, lru.begin());
+  evict(capacity);
+}
+
+void WadCache::erase(uint32_t node)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = entries.find(node);
+  if (it != entries.end()) {
+    used -= it->second->second.size();
+    lru.erase(it->second);
+    entries.erase(it);
+  }
+}
+
+void WadCache::pin(uint32_t node)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  ++pinned[node];
+}
+
+void WadCache::unpin(uint32_t node)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = pinned.find(node);
+  if (it != pinned.end() && !--it->second) {
+    pinned.erase(it);
+  }
+  ++unpins;
+}
+
+void WadCache::evict(size_t limit)
+{
+  while (used > limit) {
+    auto& last = lru.back();
+    used -= last.second.size();
+    entries.erase(last.first);
+    lru.pop_back();
+  }
+}
+
+void WadCache::resize(size_t capacity)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  this->capacity = capacity;
+  evict(capacity);
+}
+
+WadCacheStats WadCache::stats()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return { hits, misses, used, entries.size() };
+}
+
+/* A capacity of 0 (the default) turns the cache off and empties it. */
+void Wad::setCacheSize(size_t bytes)
+{
+  std::unique_lock<WadLock> guard(lock);
+  cache.resize(bytes);
+}
+
+WadCacheStats Wad::getCacheStats()
+{
+  return cache.stats();
+}
+
+WadRing::~WadRing()
+{
+  if (fd >= 0) {
+    munmap(sqes, entries * sizeof(io_uring_sqe));
+    munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(fd);
+  }
+}
+
+bool WadRing::ready()
+{
+  if (fd >= 0 || failed) {
+    return fd >= 0;
+  }
+  struct io_uring_params params {};
+  int ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (ring_fd < 0) {
+    failed = true;
+    return false;
+  }
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  void *sqe_map = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqe_map == MAP_FAILED) {
+    if (sq_ring != MAP_FAILED) {
+      munmap(sq_ring, sq_ring_size);
+    }
+    if (cq_ring != MAP_FAILED) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sqe_map != MAP_FAILED) {
+      munmap(sqe_map, params.sq_entries * sizeof(io_uring_sqe));
+    }
+    close(ring_fd);
+    failed = true;
+    return false;
+  }
+  char *sq = static_cast<char *>(sq_ring);
+  char *cq = static_cast<char *>(cq_ring);
+  sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  sqes = static_cast<io_uring_sqe *>(sqe_map);
+  entries = params.sq_entries;
+  fd = ring_fd;
+  return true;
+}
+
+/* A cleared submission queue entry, or null if the queue is full. */
+io_uring_sqe *WadRing::next()
+{
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *sq_tail + queued;
+  if (tail - head >= entries) {
+    return nullptr;
+  }
+  unsigned index = tail & *sq_mask;
+  sq_array[index] = index;
+  ++queued;
+  io_uring_sqe *sqe = &sqes[index];
+  *sqe = {};
+  return sqe;
+}
+
+/* Submit everything next() handed out that the kernel has not picked up
+ * yet, and wait for at least wait completions. */
+int WadRing::submit(unsigned wait)
+{
+  unsigned tail = *sq_tail + queued;
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+  queued = 0;
+  int ret;
+  do {
+    unsigned count = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    ret = syscall(__NR_io_uring_enter, fd, count, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+bool WadRing::notify(int efd)
+{
+  return !syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1);
+}
+
+/* Take back what next() handed out that the kernel has not picked up
+ * yet, which is always the most recent. Returns how many. */
+unsigned WadRing::withdraw()
+{
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  unsigned count = *sq_tail + queued - head;
+  __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+  queued = 0;
+  return count;
+}
+
+bool WadRing::reap(uint64_t *data, int *res)
+{
+  unsigned head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  io_uring_cqe *cqe = &cqes[head & *cq_mask];
+  *data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/*
+ * Every change to the descriptor table goes through update(), which
+ * writes the header and the descriptors in [begin, end). With WAD_WRITEBACK
+ * it only marks the table dirty: lump data still goes to disk right away
+ * (on top of the stale table, if need be), but the header and table are
+ * written once by flush(). flush() runs on request, when the Wad is
+ * destroyed, and, once setFlushInterval() has been called, from a thread
+ * that writes the table when it has been dirty for the interval, whether
+ * or not anything else changes.
+ */
+
+void Wad::update(uint32_t begin, uint32_t end)
+{
+  if (batching) {
+    batch_from = std::min(batch_from, begin);
+    return;
+  }
+  if (!(flags & WAD_WRITEBACK)) {
+    uint32_t counts[2] = { (uint32_t)descriptors.size(), doffset };
+    pwrite(fd, counts, sizeof(counts), 4);
+    pwrite(fd, descriptors.data() + begin, (end - begin) * sizeof(WadDescriptor), doffset + begin * sizeof(WadDescriptor));
+    return;
+  }
+  if (!dirty) {
+    dirty = true;
+    dirty_since = std::chrono::steady_clock::now();
+    kick_flusher();
+  }
+}
+
+int Wad::flush()
+{
+  std::unique_lock<WadLock> guard(lock);
+  int ret = dirty && !batching ? write_table() : 0;
+  return write_checksums() ? -1 : ret;
+}
+
+int Wad::write_table()
+{
+  uint32_t counts[2] = { (uint32_t)descriptors.size(), doffset };
+  size_t size = descriptors.size() * sizeof(WadDescriptor);
+  if (pwrite(fd, descriptors.data(), size, doffset) != (ssize_t)size
+      || pwrite(fd, counts, sizeof(counts), 4) != sizeof(counts)) {
+    return -1;
+  }
+  dirty = false;
+  return 0;
+}
+
+void Wad::setFlushInterval(int milliseconds)
+{
+  std::unique_lock<WadLock> guard(lock);
+  flush_interval = std::chrono::milliseconds(milliseconds);
+  if (!flusher.joinable() && milliseconds > 0) {
+    flusher = std::thread(&Wad::flush_loop, this);
+  }
+  kick_flusher();
+}
+
+/* Has the flusher look at the table again. Called with the lock held. */
+void Wad::kick_flusher()
+{
+  std::lock_guard<std::mutex> guard(flusher_lock);
+  flusher_kicked = true;
+  flusher_wake.notify_one();
+}
+
+/* Writes the table if it is due, and returns how long until it next
+ * could be, or 0 if there is no interval. */
+std::chrono::milliseconds Wad::flush_due()
+{
+  std::unique_lock<WadLock> guard(lock);
+  if (!flush_interval.count() || !dirty || batching) {
+    return flush_interval;
+  }
+  auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - dirty_since);
+  if (waited < flush_interval) {
+    return flush_interval - waited;
+  }
+  write_table();
+  return flush_interval;
+}
+
+/* The flusher never holds flusher_lock while it takes the Wad lock, which
+ * is always taken first. */
+void Wad::flush_loop()
+{
+  for (;;) {
+    std::chrono::milliseconds wait = flush_due();
+    std::unique_lock<std::mutex> guard(flusher_lock);
+    auto woken = [this]() { return flusher_stop || flusher_kicked; };
+    if (wait.count()) {
+      flusher_wake.wait_for(guard, wait, woken);
+    } else {
+      flusher_wake.wait(guard, woken);
+    }
+    if (flusher_stop) {
+      return;
+    }
+    flusher_kicked = false;
+  }
+}
+
+/*
+ * Checksums. With WAD_CHECKSUM every lump has a CRC32C, kept by the
+ * offset of its extent, so lumps sharing an extent share it too. Appends
+ * extend a lump's checksum from the new data alone; other writes read
+ * the rest of the lump back. They are stored in a .crc file next to the
+ * WAD, rewritten by flush() (and so when the Wad is closed), as the
+ * magic "WCRC", a count and then offset, size and crc for each extent.
+ * Changes made to the WAD without WAD_CHECKSUM are not tracked.
+ */
+
+static uint32_t crc_table[8][256];
+
+static void crc_init()
+{
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int k = 0; k < 8; ++k) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    crc_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (int t = 1; t < 8; ++t) {
+      crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+    }
+  }
+}
+
+static uint32_t crc_software(uint32_t crc, const unsigned char *p, size_t size)
+{
+  static bool ready = (crc_init(), true);
+  (void)ready;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v ^= crc;
+    crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff]
+        ^ crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff]
+        ^ crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff]
+        ^ crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+  }
+  while (size--) {
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hardware(uint32_t crc, const unsigned char *p, size_t size)
+{
+  uint64_t crc64 = crc;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc64 = _mm_crc32_u64(crc64, v);
+  }
+  crc = crc64;
+  while (size--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+uint32_t wadCrc32c(uint32_t crc, const char *data, size_t size)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+#if defined(__x86_64__)
+  static bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware) {
+    return ~crc_hardware(~crc, p, size);
+  }
+#endif
+  return ~crc_software(~crc, p, size);
+}
+
+uint32_t Wad::crc_extent(uint32_t crc, uint32_t offset, uint32_t size)
+{
+  char buf[65536];
+  while (size) {
+    ssize_t n = pread(fd, buf, std::min<uint32_t>(size, sizeof(buf)), offset);
+    if (n <= 0) {
+      break;
+    }
+    crc = wadCrc32c(crc, buf, n);
+    offset += n;
+    size -= n;
+  }
+  return crc;
+}
+
+/* Record the checksum of the lump now at to, forgetting the one at from
+ * if it moved off an extent no other lump used (shared is whether one
+ * did before the move; the refcount may already be gone). */
+void Wad::set_checksum(uint32_t from, uint32_t to, WadChecksum sum, bool shared)
+{
+  std::lock_guard<std::mutex> guard(checksum_lock);
+  if (from != to && !shared) {
+    checksums.erase(from);
+  }
+  checksums[to] = sum;
+  checksums_dirty = true;
+}
+
+/* Called once reserve has placed a write, with the lump as it was. */
+void Wad::sum_write(uint32_t node, const WadDescriptor& old, bool shared, const char *buffer, int length, int offset)
+{
+  WadDescriptor *desc = resolve(node);
+  bool append = (uint32_t)offset == old.size;
+  uint32_t crc = 0;
+  if (append && old.size) {
+    std::lock_guard<std::mutex> guard(checksum_lock);
+    auto sum = checksums.find(old.offset);
+    append = sum != checksums.end() && sum->second.size == old.size;
+    crc = append ? sum->second.crc : 0;
+  }
+  if (append) {
+    crc = wadCrc32c(crc, buffer, length);
+  } else {
+    crc = crc_extent(0, desc->offset, offset);
+    crc = wadCrc32c(crc, buffer, length);
+    crc = crc_extent(crc, desc->offset + offset + length, desc->size - offset - length);
+  }
+  set_checksum(old.size ? old.offset : desc->offset, desc->offset, { desc->size, crc }, shared);
+}
+
+void Wad::read_checksums()
+{
+  int cfd = open(checksum_path.c_str(), O_RDONLY);
+  if (cfd < 0) {
+    return;
+  }
+  uint32_t head[2];
+  struct stat st;
+  if (fstat(cfd, &st) || pread(cfd, head, sizeof(head), 0) != sizeof(head) || memcmp(head, "WCRC", 4)
+      || (uint64_t)st.st_size != sizeof(head) + (uint64_t)head[1] * 3 * sizeof(uint32_t)) {
+    /* Not one of ours, or cut short: start over. */
+    checksums_dirty = true;
+  } else {
+    std::vector<uint32_t> entries((size_t)head[1] * 3);
+    ssize_t size = entries.size() * sizeof(uint32_t);
+    if (pread(cfd, entries.data(), size, sizeof(head)) == size) {
+      for (size_t i = 0; i < entries.size(); i += 3) {
+        checksums[entries[i]] = { entries[i + 1], entries[i + 2] };
+      }
+    }
+  }
+  close(cfd);
+}
+
+/* Written to a temporary file and renamed over the old one, so that the
+ * .crc file is always complete. */
+int Wad::write_checksums()
+{
+  std::lock_guard<std::mutex> guard(checksum_lock);
+  if (!checksums_dirty) {
+    return 0;
+  }
+  std::vector<uint32_t> entries = { 0, (uint32_t)checksums.size() };
+  memcpy(entries.data(), "WCRC", 4);
+  std::map<uint32_t, WadChecksum> sorted(checksums.begin(), checksums.end());
+  for (auto& sum : sorted) {
+    entries.insert(entries.end(), { sum.first, sum.second.size, sum.second.crc });
+  }
+  std::string tmp = checksum_path + ".tmp";
+  int cfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (cfd < 0) {
+    return -1;
+  }
+  ssize_t size = entries.size() * sizeof(uint32_t);
+  bool ok = write(cfd, entries.data(), size) == size;
+  if (close(cfd) || !ok || rename(tmp.c_str(), checksum_path.c_str())) {
+    unlink(tmp.c_str());
+    return -1;
+  }
+  checksums_dirty = false;
+  return 0;
+}
+
+/*
+ * Check every lump against its checksum, and give one to those that do
+ * not have one yet; bad gets the paths of lumps that failed. Extents are
+ * read in file order and split into one contiguous run per thread, so
+ * each thread reads sequentially. Without WAD_CHECKSUM nothing is known
+ * and nothing is checked.
+ */
+WadVerifyStats Wad::verify(std::vector<std::string> *bad, int threads)
+{
+  WadVerifyStats stats {};
+  if (!(flags & WAD_CHECKSUM)) {
+    return stats;
+  }
+  {
+    std::unique_lock<WadLock> guard(lock);
+    materialize();
+  }
+  std::shared_lock<WadLock> guard(lock);
+
+  struct Extent
+  {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t crc;
+  };
+  std::vector<Extent> extents;
+  for (WadDescriptor& desc : descriptors) {
+    if (desc.size) {
+      extents.push_back({ desc.offset, desc.size, 0 });
+    }
+  }
+  std::sort(extents.begin(), extents.end(), [](const Extent& a, const Extent& b) {
+    return a.offset < b.offset;
+  });
+  extents.erase(std::unique(extents.begin(), extents.end(), [](const Extent& a, const Extent& b) {
+    return a.offset == b.offset;
+  }), extents.end());
+  for (Extent& extent : extents) {
+    stats.bytes += extent.size;
+  }
+
+  if (threads <= 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::vector<std::thread> pool;
+  size_t next = 0;
+  uint64_t share = stats.bytes / threads + 1;
+  while (next < extents.size()) {
+    size_t begin = next;
+    for (uint64_t bytes = 0; next < extents.size() && bytes < share; ++next) {
+      bytes += extents[next].size;
+    }
+    pool.emplace_back([this, &extents, begin, end = next]() {
+      for (size_t i = begin; i < end; ++i) {
+        extents[i].crc = crc_extent(0, extents[i].offset, extents[i].size);
+      }
+    });
+  }
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+
+  std::set<uint32_t> failed;
+  {
+    std::lock_guard<std::mutex> sums(checksum_lock);
+    for (Extent& extent : extents) {
+      auto sum = checksums.find(extent.offset);
+      if (sum != checksums.end() && sum->second.size == extent.size) {
+        ++stats.lumps;
+        if (sum->second.crc != extent.crc) {
+          ++stats.bad;
+          failed.insert(extent.offset);
+        }
+      } else {
+        checksums[extent.offset] = { extent.size, extent.crc };
+        checksums_dirty = true;
+        ++stats.added;
+      }
+    }
+  }
+  if (bad && !failed.empty()) {
+    for (uint32_t id = 1; id < nodes.size(); ++id) {
+      WadDescriptor *desc = resolve(id);
+      if (is_file(desc) && desc->size && failed.count(desc->offset)) {
+        bad->push_back(node_path(id));
+      }
+    }
+  }
+  return stats;
+}
+
+/*
+ * WadStack. The merged index is built by walking each layer in turn and
+ * laying its entries over what is there: a new path gets a new node at
+ * the end of its directory, and an existing one is taken over by the
+ * later layer unless both are directories. A node keeps its id and place
+ * in the listing when it is taken over. Within one layer the first of
+ * two entries with the same name wins, as it does in a Wad.
+ */
+
+WadStack::~WadStack()
+{
+  for (Wad *layer : layers) {
+    delete layer;
+  }
+}
+
+WadStack *WadStack::loadStack(const std::vector<std::string>& paths, int flags)
+{
+  std::unique_ptr<WadStack> stack(new WadStack());
+  stack->nodes.push_back({ 0, 0, true, "/", {} });
+  stack->paths.emplace("/", 0);
+  for (const std::string& path : paths) {
+    Wad *layer = Wad::loadWad(path, flags);
+    if (!layer) {
+      return nullptr;
+    }
+    stack->layers.push_back(layer);
+    stack->merge(stack->layers.size() - 1, 0, 0);
+  }
+  return stack->layers.empty() ? nullptr : stack.release();
+}
+
+void WadStack::merge(uint32_t layer, uint32_t wad_node, uint32_t id)
+{
+  std::vector<WadEntry> entries;
+  layers[layer]->listDirectory(wad_node, &entries);
+  std::string prefix = id ? nodes[id].path : "";
+  for (WadEntry& entry : entries) {
+    std::string path = prefix + "/" + entry.name;
+    auto it = paths.find(path);
+    uint32_t child;
+    if (it == paths.end()) {
+      child = nodes.size();
+      nodes.push_back({ layer, entry.node, entry.directory, path, {} });
+      nodes[id].children.push_back(child);
+      paths.emplace(path, child);
+    } else {
+      child = it->second;
+      WadStackNode& node = nodes[child];
+      if (node.layer == layer && node.node != entry.node) {
+        continue;
+      }
+      if (!node.directory || !entry.directory) {
+        drop(child);
+        node.directory = entry.directory;
+      }
+      node.layer = layer;
+      node.node = entry.node;
+    }
+    if (entry.directory) {
+      merge(layer, entry.node, child);
+    }
+  }
+}
+
+/* Forget everything below a node that is being replaced. */
+void WadStack::drop(uint32_t id)
+{
+  for (uint32_t child : nodes[id].children) {
+    drop(child);
+    paths.erase(nodes[child].path);
+  }
+  nodes[id].children.clear();
+}
+
+uint32_t WadStack::lookup(const std::string& path)
+{
+  std::string key;
+  if (!normalize(path, key)) {
+    return WAD_NONE;
+  }
+  auto it = paths.find(key);
+  return it == paths.end() ? WAD_NONE : it->second;
+}
+
+size_t WadStack::getLayerCount()
+{
+  return layers.size();
+}
+
+bool WadStack::isContent(const std::string& path)
+{
+  return isContent(lookup(path));
+}
+
+bool WadStack::isDirectory(const std::string& path)
+{
+  return isDirectory(lookup(path));
+}
+
+int WadStack::getSize(const std::string& path)
+{
+  return getSize(lookup(path));
+}
+
+int WadStack::getContents(const std::string& path, char *buffer, int length, int offset)
+{
+  return getContents(lookup(path), buffer, length, offset);
+}
+
+uint32_t WadStack::getNode(const std::string& path)
+{
+  return lookup(path);
+}
+
+uint32_t WadStack::getChild(uint32_t node, const std::string& name)
+{
+  if (!isDirectory(node)) {
+    return WAD_NONE;
+  }
+  auto it = paths.find((node ? nodes[node].path : "") + "/" + name);
+  return it == paths.end() ? WAD_NONE : it->second;
+}
+
+std::string WadStack::getPath(uint32_t node)
+{
+  return node < nodes.size() ? nodes[node].path : "";
+}
+
+bool WadStack::isContent(uint32_t node)
+{
+  return node < nodes.size() && !nodes[node].directory;
+}
+
+bool WadStack::isDirectory(uint32_t node)
+{
+  return node < nodes.size() && nodes[node].directory;
+}
+
+int WadStack::getSize(uint32_t node)
+{
+  if (!isContent(node)) {
+    return -1;
+  }
+  return layers[nodes[node].layer]->getSize(nodes[node].node);
+}
+
+int WadStack::getContents(uint32_t node, char *buffer, int length, int offset)
+{
+  if (!isContent(node)) {
+    return -1;
+  }
+  return layers[nodes[node].layer]->getContents(nodes[node].node, buffer, length, offset);
+}
+
+int WadStack::getExtent(uint32_t node, int *fd, uint32_t *offset)
+{
+  if (!isContent(node)) {
+    return -1;
+  }
+  return layers[nodes[node].layer]->getExtent(nodes[node].node, fd, offset);
+}
+
+int WadStack::getDirectory(const std::string& path, std::vector<std::string> *directory)
+{
+  uint32_t node = lookup(path);
+  if (!isDirectory(node)) {
+    return -1;
+  }
+  for (uint32_t child : nodes[node].children) {
+    directory->push_back(nodes[child].path.substr(nodes[child].path.rfind('/') + 1));
+  }
+  return nodes[node].children.size();
+}
+
+int WadStack::listDirectory(const std::string& path, std::vector<WadEntry> *entries)
+{
+  return listDirectory(lookup(path), entries);
+}
+
+int WadStack::listDirectory(uint32_t node, std::vector<WadEntry> *entries)
+{
+  if (!isDirectory(node)) {
+    return -1;
+  }
+  for (uint32_t child : nodes[node].children) {
+    const WadStackNode& entry = nodes[child];
+    std::string name = entry.path.substr(entry.path.rfind('/') + 1);
+    entries->push_back({ name, child, entry.directory, entry.directory ? 0 : (uint32_t)getSize(child) });
+  }
+  return nodes[node].children.size();
+}
+
+bool wadIsMarker(const std::string& name)
+{
+  char padded[sizeof(WadDescriptor::name) + 1] = {};
+  if (name.size() > sizeof(WadDescriptor::name)) {
+    return false;
+  }
+  memcpy(padded, name.data(), name.size());
+  return is_start(padded) || is_map(padded) || is_end(padded);
+}
+
+WadWriter::~WadWriter()
+{
+  close(fd);
+}
+
+WadWriter *WadWriter::createWad(const std::string& path, const std::string& magic)
+{
+  if (magic != "IWAD" && magic != "PWAD" && magic != "ZWAD") {
+    return nullptr;
+  }
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+  WadWriter *writer = new WadWriter();
+  writer->fd = fd;
+  memcpy(writer->magic, magic.data(), sizeof(writer->magic));
+  writer->pos = sizeof(WadHeader);
+  return writer;
+}
+
+int WadWriter::getFd()
+{
+  return fd;
+}
+
+bool WadWriter::beginDirectory(const std::string& name)
+{
+  if (name.empty() || name.size() > 2 || name.find('/') != std::string::npos) {
+    return false;
+  }
+  WadDescriptor start {};
+  memcpy(start.name, name.data(), name.size());
+  memcpy(start.name + name.size(), "_START", 6);
+  descriptors.push_back(start);
+  open_dirs.push_back(name);
+  return true;
+}
+
+bool WadWriter::endDirectory()
+{
+  if (open_dirs.empty()) {
+    return false;
+  }
+  WadDescriptor end {};
+  memcpy(end.name, open_dirs.back().data(), open_dirs.back().size());
+  memcpy(end.name + open_dirs.back().size(), "_END", 4);
+  descriptors.push_back(end);
+  open_dirs.pop_back();
+  return true;
+}
+
+/* Returns the offset the size stored bytes of the lump go at, for the
+ * caller to write through getFd(); for a ZWAD they must come from
+ * wadEncode. WAD_NONE if the name cannot be used or the lump would not
+ * fit below 4 GiB. */
+uint32_t WadWriter::reserveLump(const std::string& name, uint32_t size)
+{
+  WadDescriptor lump {};
+  if (name.empty() || name.size() > sizeof(lump.name) || name.find('/') != std::string::npos
+      || wadIsMarker(name) || size > UINT32_MAX - pos) {
+    return WAD_NONE;
+  }
+  memcpy(lump.name, name.data(), name.size());
+  if (size) {
+    lump.offset = pos;
+    lump.size = size;
+    pos += size;
+  }
+  descriptors.push_back(lump);
+  return lump.offset;
+}
+
+int WadWriter::addLump(const std::string& name, const char *data, uint32_t size)
+{
+  std::string encoded;
+  if (!memcmp(magic, "ZWAD", 4)) {
+    encoded = wadEncode(data, size);
+    data = encoded.data();
+    size = encoded.size();
+  }
+  uint32_t offset = reserveLump(name, size);
+  if (offset == WAD_NONE) {
+    return -1;
+  }
+  for (uint32_t done = 0; done < size;) {
+    ssize_t n = pwrite(fd, data + done, size - done, offset + done);
+    if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+int WadWriter::finish()
+{
+  if (!open_dirs.empty()) {
+    return -1;
+  }
+  size_t size = descriptors.size() * sizeof(WadDescriptor);
+  if (size > UINT32_MAX - pos) {
+    return -1;
+  }
+  WadHeader header;
+  memcpy(header.magic, magic, sizeof(header.magic));
+  header.dcount = descriptors.size();
+  header.doffset = pos;
+  if (pwrite(fd, descriptors.data(), size, pos) != (ssize_t)size
+      || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+      || ftruncate(fd, pos + size)) {
+    return -1;
+  }
+  return 0;
+}
+
+int WadStack::flush()
+{
+  int ret = 0;
+  for (Wad *layer : layers) {
+    ret |= layer->flush();
+  }
+  return ret ? -1 : 0;
 }
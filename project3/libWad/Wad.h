@@ -1,5 +1,17 @@
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include <pthread.h>
 #include <stdint.h>
 
 struct WadHeader
@@ -17,27 +29,439 @@ struct WadDescriptor
 };
 
 #define WAD_ROOT reinterpret_cast<WadDescriptor *>(-1)
+#define WAD_NONE UINT32_MAX
 
+/* Flags for Wad::loadWad. */
+#define WAD_MMAP 0x1 /* serve reads from a read-only mapping of the file */
+#define WAD_SEQUENTIAL 0x2 /* with WAD_MMAP, hint sequential access */
+#define WAD_RANDOM 0x4 /* with WAD_MMAP, hint random access */
+#define WAD_WRITEBACK 0x8 /* defer header and descriptor table writes until flush() */
+#define WAD_SLACK 0x10 /* keep free space after the data and free descriptor slots */
+#define WAD_OVERWRITE 0x20 /* allow writes anywhere in a lump, relocating it as needed */
+#define WAD_LAZY 0x40 /* map the descriptor table (if 4-aligned) and index directories on first use */
+#define WAD_CHECKSUM 0x80 /* keep a CRC32C of every lump in a .crc file next to the WAD */
+
+/*
+ * ZWAD files are WADs whose lumps are stored compressed, in chunks of
+ * WAD_CHUNK_SIZE bytes so that a read only has to decompress the chunks
+ * it covers. wadEncode turns lump contents into that stored form.
+ */
+#define WAD_CHUNK_SIZE 65536
+std::string wadEncode(const char *data, uint32_t size);
+
+/* Where the chunks of a compressed lump are; chunk i is stored at
+ * [chunks[i], chunks[i + 1]) from the start of the lump. */
+struct WadFrame
+{
+  uint32_t raw_size;
+  uint32_t chunk_size;
+  std::vector<uint32_t> chunks;
+};
+
+/* A file or directory in the in-memory index. Node 0 is the root.
+ * Node ids never change; positions in the descriptor table do. */
+struct WadNode
+{
+  uint32_t index; /* position of the descriptor (or _START marker) */
+  uint32_t end; /* position of the _END marker, or index if there is none */
+  uint32_t parent;
+  std::vector<uint32_t> children;
+  bool listed; /* children are in the index; only ever false with WAD_LAZY */
+};
+
+/* An entry in a directory listing; see Wad::listDirectory. */
+struct WadEntry
+{
+  std::string name;
+  uint32_t node;
+  bool directory;
+  uint32_t size; /* 0 for directories */
+};
+
+/* Unused extents of the file, indexed both ways for best-fit allocation. */
+class WadFreeMap
+{
+  std::map<uint32_t, uint32_t> by_offset;
+  std::set<std::pair<uint32_t, uint32_t>> by_size;
+
+  void erase(std::map<uint32_t, uint32_t>::iterator it);
+  void insert(uint32_t offset, uint32_t size);
+
+public:
+  void add(uint32_t offset, uint32_t size);
+  bool take(uint32_t size, uint32_t *offset);
+  bool extend(uint32_t offset, uint32_t size);
+  void trim(uint32_t *end);
+  void clear();
+};
+
+/*
+ * A reader-writer lock that lets a waiting writer in ahead of new
+ * readers; WadLock on glibc keeps letting readers through, so
+ * a steady stream of reads could hold off a write for good. It is not
+ * recursive: a thread must not take it shared twice.
+ */
+class WadLock
+{
+  pthread_rwlock_t rwlock;
+
+public:
+  WadLock();
+  ~WadLock();
+  WadLock(const WadLock&) = delete;
+  WadLock& operator=(const WadLock&) = delete;
+
+  void lock();
+  bool try_lock();
+  void unlock();
+  void lock_shared();
+  bool try_lock_shared();
+  void unlock_shared();
+};
+
+struct WadCacheStats
+{
+  uint64_t hits;
+  uint64_t misses;
+  size_t bytes; /* currently cached */
+  size_t entries;
+};
+
+/* What Wad::verify found. Lumps without a checksum yet get one. */
+struct WadVerifyStats
+{
+  uint32_t lumps; /* checked against their checksum */
+  uint32_t bad;
+  uint32_t added;
+  uint64_t bytes;
+};
+
+/* The checksum of a lump stored at some offset, by that offset. */
+struct WadChecksum
+{
+  uint32_t size;
+  uint32_t crc;
+};
+
+/* CRC32C, continuing from crc; SSE4.2 is used where the CPU has it. */
+uint32_t wadCrc32c(uint32_t crc, const char *data, size_t size);
+
+/* Whole lump contents by node, least recently used first out once the
+ * total size passes the capacity. Has its own lock, since readers that
+ * share the Wad lock still fill it. A pinned node (one with a write in
+ * flight) is not filled, and neither is anything read from the file
+ * before the last unpin. */
+class WadCache
+{
+  std::mutex lock;
+  size_t capacity = 0;
+  size_t used = 0;
+  std::list<std::pair<uint32_t, std::string>> lru; /* most recent first */
+  std::unordered_map<uint32_t, decltype(lru)::iterator> entries;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  std::unordered_map<uint32_t, uint32_t> pinned; /* node -> writes in flight */
+  uint64_t unpins = 0;
+
+  void evict(size_t limit);
+
+public:
+  bool enabled();
+  bool fits(size_t size);
+  bool get(uint32_t node, char *buffer, int length, int offset);
+  uint64_t ticket();
+  void put(uint32_t node, std::string data, uint64_t ticket);
+  void erase(uint32_t node);
+  void pin(uint32_t node);
+  void unpin(uint32_t node);
+  void resize(size_t capacity);
+  WadCacheStats stats();
+};
+
+/* One read for Wad::getContentsBatch. result is filled in: the number of
+ * bytes read, as getContents would return it, or -1. */
+struct WadRead
+{
+  uint32_t node;
+  char *buffer;
+  int length;
+  int offset;
+  int result;
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* A bare io_uring, set up with the raw system calls so that there is no
+ * extra library to link. Set up on first use; ready() is false if the
+ * kernel does not have io_uring (or will not let us use it). */
+class WadRing
+{
+  int fd = -1;
+  bool failed = false;
+  unsigned entries = 0;
+  void *sq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  void *cq_ring = nullptr;
+  size_t cq_ring_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+  unsigned queued = 0;
+
+public:
+  std::mutex lock;
+
+  ~WadRing();
+  bool ready();
+  io_uring_sqe *next();
+  int submit(unsigned wait);
+  unsigned withdraw();
+  bool reap(uint64_t *data, int *res);
+  bool notify(int efd);
+};
+
+/* Called with what the blocking call would have returned. */
+typedef std::function<void(int)> WadCallback;
+
+/* An asynchronous read or write in flight. */
+struct WadPending
+{
+  WadCallback done;
+  char *buffer;
+  int length;
+  uint64_t pos;
+  bool write;
+};
+
+/*
+ * A Wad can be shared between threads. Queries take a shared lock and
+ * anything that changes the file or the index takes an exclusive one,
+ * so readers only wait for writers, and writers only for the readers
+ * already in. Pointers and views handed out (see getContentsView) are
+ * still only good until the next write.
+ */
 class Wad
 {
+  WadLock lock;
   int fd;
+  int flags;
+  char *mapping;
+  size_t mapping_size;
   char magic[4];
   uint32_t doffset;
+  uint32_t dend;
+  uint32_t slack;
+  bool dirty;
+  std::chrono::steady_clock::time_point dirty_since;
+  std::chrono::milliseconds flush_interval;
+  std::thread flusher;
+  std::mutex flusher_lock;
+  std::condition_variable flusher_wake;
+  bool flusher_stop;
+  bool flusher_kicked;
+  bool batching;
+  uint32_t batch_base;
+  uint32_t batch_from;
+  std::vector<uint32_t> batch_parents;
   std::vector<WadDescriptor> descriptors;
+  WadDescriptor *lazy_table = nullptr;
+  uint32_t lazy_count = 0;
+  void *lazy_map = nullptr;
+  size_t lazy_map_size = 0;
+  std::vector<WadNode> nodes;
+  std::unordered_map<std::string, uint32_t> paths;
+  WadFreeMap free_map;
+  std::unordered_map<uint32_t, uint32_t> shares; /* extent offset -> lumps stored there, if more than one */
+  bool contents_indexed = false;
+  std::unordered_multimap<uint64_t, uint32_t> by_content;
+  std::unordered_map<uint32_t, uint64_t> content_of;
+  std::string checksum_path;
+  std::mutex checksum_lock; /* covers checksums and checksums_dirty */
+  std::unordered_map<uint32_t, WadChecksum> checksums;
+  bool checksums_dirty = false;
+  WadCache cache;
+  bool compressed;
+  std::mutex frame_lock;
+  std::unordered_map<uint32_t, WadFrame> frames;
+  WadRing ring;
+  WadRing async_ring; /* its lock also covers the async_ fields */
+  int async_fd = -1;
+  bool async_setup = false;
+  uint64_t async_next = 0;
+  std::unordered_map<uint64_t, WadPending> async_pending;
+  std::vector<std::pair<WadCallback, int>> async_done;
 
+  void map_file();
+  void build_free_map();
+  uint32_t allocate(uint32_t size);
+  void release(uint32_t offset, uint32_t size);
+  void unref(uint32_t offset, uint32_t size);
+  void count_shares();
+  void changed(uint32_t node);
+  uint64_t hash_extent(uint32_t offset, uint32_t size);
+  bool same_extent(uint32_t a, uint32_t b, uint32_t size);
+  void index_contents();
+  uint32_t share(uint32_t node);
+  void copy(uint32_t from, uint32_t to, uint32_t size);
+  void update(uint32_t begin, uint32_t end);
+  int reserve(uint32_t node, int length, int offset, uint32_t *pos, WadDescriptor *old, bool *shared);
+  uint32_t crc_extent(uint32_t crc, uint32_t offset, uint32_t size);
+  void sum_write(uint32_t node, const WadDescriptor& old, bool shared, const char *buffer, int length, int offset);
+  void set_checksum(uint32_t from, uint32_t to, WadChecksum sum, bool shared);
+  void read_checksums();
+  int write_checksums();
+  void settle(WadDescriptor *desc);
+  bool read_frame(uint32_t node, const WadDescriptor *desc, WadFrame& frame);
+  uint32_t lump_size(uint32_t node, const WadDescriptor *desc);
+  int read_compressed(uint32_t node, const WadDescriptor *desc, char *buffer, int length, int offset);
+  int write_compressed(uint32_t node, const char *buffer, int length, int offset);
+  bool async_ready();
+  void submit_async(WadPending pending);
+  void complete_async(WadCallback done, int result);
+  void reap_async(std::vector<std::pair<WadCallback, int>>& done);
+  bool drain_async();
+  void fail_async();
+  int write_table();
+  void kick_flusher();
+  std::chrono::milliseconds flush_due();
+  void flush_loop();
   void skip(WadDescriptor *& desc);
-  WadDescriptor *resolve(const std::string& path, char *create_name = nullptr);
+  WadDescriptor *table();
+  uint32_t table_size();
+  void build_index(uint32_t id, const std::string& prefix, bool recurse);
+  std::string node_path(uint32_t id);
+  uint32_t load_path(const std::string& path);
+  std::shared_lock<WadLock> lock_listed(uint32_t id);
+  void materialize();
+  void find_data_end();
+  void shift_index(uint32_t index, uint32_t count);
+  uint32_t add_node(uint32_t parent, uint32_t index, uint32_t end, const std::string& path);
+  uint32_t insert(uint32_t parent, const WadDescriptor *descs, uint32_t count);
+  void emit(uint32_t id, std::vector<WadDescriptor>& table, std::vector<uint32_t>& remap);
+  uint32_t lookup(const std::string& path);
+  uint32_t lookup_parent(const std::string& path, char *name, std::string& key);
+  WadDescriptor *descriptor(uint32_t id);
+  WadDescriptor *resolve(uint32_t id);
 
 public:
   ~Wad();
-  static Wad *loadWad(const std::string& path);
+  static Wad *loadWad(const std::string& path, int flags = 0);
   std::string getMagic();
   bool isContent(const std::string& path);
   bool isDirectory(const std::string& path);
   int getSize(const std::string& path);
   int getContents(const std::string& path, char *buffer, int length, int offset = 0);
+  uint32_t getNode(const std::string& path);
+  uint32_t getChild(uint32_t node, const std::string& name);
+  std::string getPath(uint32_t node);
+  uint32_t getParent(uint32_t node);
+  int getChildren(uint32_t node, std::vector<uint32_t> *children);
+  int getDirectory(uint32_t node, std::vector<std::string> *directory);
+  int listDirectory(const std::string& path, std::vector<WadEntry> *entries);
+  int listDirectory(uint32_t node, std::vector<WadEntry> *entries);
+  bool isContent(uint32_t node);
+  bool isDirectory(uint32_t node);
+  int getSize(uint32_t node);
+  int getContents(uint32_t node, char *buffer, int length, int offset = 0);
+  int getExtent(uint32_t node, int *fd, uint32_t *offset);
+  int getContentsBatch(WadRead *reads, size_t count);
+  void getContentsAsync(uint32_t node, char *buffer, int length, int offset, WadCallback done);
+  void writeToFileAsync(uint32_t node, const char *buffer, int length, int offset, WadCallback done);
+  int getCompletionFd();
+  int runCompletions();
+  std::string_view getContentsView(const std::string& path);
   int getDirectory(const std::string& path, std::vector<std::string> *directory);
   void createDirectory(const std::string& path);
   void createFile(const std::string& path);
   int writeToFile(const std::string& path, const char *buffer, int length, int offset = 0);
+  int writeToFile(uint32_t node, const char *buffer, int length, int offset = 0);
+  void beginBatch();
+  int commitBatch();
+  int flush();
+  void setFlushInterval(int milliseconds);
+  int compact(uint32_t budget = 0);
+  int dedup();
+  int dedup(uint32_t node);
+  WadVerifyStats verify(std::vector<std::string> *bad = nullptr, int threads = 0);
+  void setCacheSize(size_t bytes);
+  WadCacheStats getCacheStats();
+};
+
+/* A path in a WadStack and the layer it comes from. */
+struct WadStackNode
+{
+  uint32_t layer;
+  uint32_t node;
+  bool directory;
+  std::string path;
+  std::vector<uint32_t> children;
+};
+
+/*
+ * A read-only view of several WADs stacked on top of each other, such as
+ * an IWAD and the PWADs loaded over it. Later layers win: a file replaces
+ * whatever was at its path, and directories are merged. The merged index
+ * is built once when the stack is loaded; node ids are its own, and each
+ * read goes to the layer that owns the lump.
+ */
+class WadStack
+{
+  std::vector<Wad *> layers;
+  std::vector<WadStackNode> nodes;
+  std::unordered_map<std::string, uint32_t> paths;
+
+  void merge(uint32_t layer, uint32_t wad_node, uint32_t id);
+  void drop(uint32_t id);
+  uint32_t lookup(const std::string& path);
+
+public:
+  ~WadStack();
+  static WadStack *loadStack(const std::vector<std::string>& paths, int flags = 0);
+  size_t getLayerCount();
+  bool isContent(const std::string& path);
+  bool isDirectory(const std::string& path);
+  int getSize(const std::string& path);
+  int getContents(const std::string& path, char *buffer, int length, int offset = 0);
+  uint32_t getNode(const std::string& path);
+  uint32_t getChild(uint32_t node, const std::string& name);
+  std::string getPath(uint32_t node);
+  bool isContent(uint32_t node);
+  bool isDirectory(uint32_t node);
+  int getSize(uint32_t node);
+  int getContents(uint32_t node, char *buffer, int length, int offset = 0);
+  int getExtent(uint32_t node, int *fd, uint32_t *offset);
+  int getDirectory(const std::string& path, std::vector<std::string> *directory);
+  int listDirectory(const std::string& path, std::vector<WadEntry> *entries);
+  int listDirectory(uint32_t node, std::vector<WadEntry> *entries);
+  int flush();
 };
+
+/*
+ * Writes a new WAD front to back in one pass: lumps are placed one after
+ * another as they are added, and the descriptor table and header are
+ * written once, by finish(). With the ZWAD magic, addLump compresses.
+ */
+class WadWriter
+{
+  int fd;
+  char magic[4];
+  uint32_t pos;
+  std::vector<WadDescriptor> descriptors;
+  std::vector<std::string> open_dirs;
+
+public:
+  ~WadWriter();
+  static WadWriter *createWad(const std::string& path, const std::string& magic = "PWAD");
+  int getFd();
+  bool beginDirectory(const std::string& name);
+  bool endDirectory();
+  int addLump(const std::string& name, const char *data, uint32_t size);
+  uint32_t reserveLump(const std::string& name, uint32_t size);
+  int finish();
+};
+
+/* Whether a lump name would be read as a marker (a map, or a namespace
+ * _START/_END) rather than a file; such names cannot be added. */
+bool wadIsMarker(const std::string& name);
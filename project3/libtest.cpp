@@ -1,6 +1,10 @@
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -1163,3 +1167,1259 @@ TEST(LibFunctionalityTests, bigTest){
 
   delete testWad;
 }
+
+TEST(LibIndexTests, pathLookup){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  //Redundant slashes resolve to the same entry
+  ASSERT_TRUE(testWad->isContent("//Gl//ad/os//cake.jpg"));
+  ASSERT_TRUE(testWad->isDirectory("/Gl/ad//"));
+  ASSERT_EQ(testWad->getSize("/E1M0//01.txt"), 17);
+
+  //Created entries are visible through the index immediately
+  testWad->createDirectory("/Gl/ad/ex");
+  testWad->createFile("/Gl/ad/ex/new.txt");
+  testWad->createFile("/top.txt");
+  ASSERT_TRUE(testWad->isDirectory("/Gl/ad/ex"));
+  ASSERT_TRUE(testWad->isContent("/Gl/ad/ex/new.txt"));
+  ASSERT_TRUE(testWad->isContent("/top.txt"));
+  ASSERT_TRUE(testWad->isContent("/Gl/ad/os/cake.jpg"));
+  ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+
+  //Entries after the insertion point still read correctly
+  char buffer[17];
+  ASSERT_EQ(testWad->getContents("/mp.txt", buffer, 4), 4);
+  delete testWad;
+  testWad = Wad::loadWad(wad_path);
+  char reloaded[17];
+  ASSERT_EQ(testWad->getContents("/mp.txt", reloaded, 4), 4);
+  ASSERT_EQ(memcmp(buffer, reloaded, 4), 0);
+  ASSERT_TRUE(testWad->isContent("/Gl/ad/ex/new.txt"));
+
+  //Duplicates are rejected
+  std::vector<std::string> testVector;
+  testWad->createFile("/top.txt");
+  ASSERT_EQ(testWad->getDirectory("/", &testVector), 4);
+
+  delete testWad;
+}
+
+TEST(LibMmapTests, getContentsView){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_MMAP | WAD_RANDOM);
+
+  char buffer[17];
+  ASSERT_EQ(testWad->getContents("/E1M0/01.txt", buffer, 17), 17);
+  std::string_view view = testWad->getContentsView("/E1M0/01.txt");
+  ASSERT_EQ(view.size(), 17);
+  ASSERT_EQ(memcmp(view.data(), buffer, 17), 0);
+
+  ASSERT_EQ(testWad->getContentsView("/E1M0").data(), nullptr);
+  ASSERT_EQ(testWad->getContentsView("/nothere").data(), nullptr);
+
+  //Appended data shows up in both read paths
+  testWad->createFile("/new.txt");
+  ASSERT_EQ(testWad->writeToFile("/new.txt", "appended", 8), 8);
+  view = testWad->getContentsView("/new.txt");
+  ASSERT_EQ(view, "appended");
+  ASSERT_EQ(testWad->getContents("/new.txt", buffer, 8), 8);
+  ASSERT_EQ(memcmp(buffer, "appended", 8), 0);
+
+  delete testWad;
+
+  //Without WAD_MMAP there is nothing to view
+  testWad = Wad::loadWad(wad_path);
+  ASSERT_EQ(testWad->getContentsView("/E1M0/01.txt").data(), nullptr);
+  delete testWad;
+}
+
+TEST(LibWritebackTests, flush){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_WRITEBACK);
+
+  //Stream a file in small chunks
+  testWad->createDirectory("/Ex");
+  testWad->createFile("/Ex/big.txt");
+  std::string expected;
+  for (int i = 0; i < 100; ++i) {
+    std::string chunk = "chunk " + std::to_string(i) + "\n";
+    ASSERT_EQ(testWad->writeToFile("/Ex/big.txt", chunk.data(), chunk.size(), expected.size()), (int)chunk.size());
+    expected += chunk;
+  }
+  ASSERT_EQ(testWad->getSize("/Ex/big.txt"), (int)expected.size());
+  ASSERT_EQ(testWad->flush(), 0);
+
+  Wad* otherWad = Wad::loadWad(wad_path);
+  std::vector<char> buffer(expected.size());
+  ASSERT_EQ(otherWad->getContents("/Ex/big.txt", buffer.data(), buffer.size()), (int)expected.size());
+  ASSERT_EQ(memcmp(buffer.data(), expected.data(), expected.size()), 0);
+  ASSERT_EQ(otherWad->getSize("/mp.txt"), 398);
+  delete otherWad;
+
+  //Destroying the Wad flushes pending changes
+  testWad->createFile("/Ex/more.txt");
+  testWad->writeToFile("/Ex/more.txt", "more", 4);
+  delete testWad;
+  testWad = Wad::loadWad(wad_path);
+  ASSERT_EQ(testWad->getSize("/Ex/more.txt"), 4);
+  ASSERT_EQ(testWad->getSize("/Ex/big.txt"), (int)expected.size());
+
+  delete testWad;
+}
+
+TEST(LibWritebackTests, interval){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_WRITEBACK);
+  testWad->setFlushInterval(20);
+
+  //The last change reaches the file without another one to push it
+  testWad->createFile("/last.txt");
+  ASSERT_EQ(testWad->writeToFile("/last.txt", "last", 4), 4);
+  Wad* otherWad = nullptr;
+  for (int i = 0; i < 100; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    delete otherWad;
+    otherWad = Wad::loadWad(wad_path);
+    if (otherWad->getSize("/last.txt") == 4) {
+      break;
+    }
+  }
+  ASSERT_EQ(otherWad->getSize("/last.txt"), 4);
+  delete otherWad;
+  delete testWad;
+}
+
+TEST(LibSlackTests, namelessLump){
+  std::string wad_path = setupWorkspace();
+  int fd = open(wad_path.c_str(), O_RDWR);
+  WadHeader header;
+  pread(fd, &header, sizeof(header), 0);
+  WadDescriptor last;
+  uint32_t at = header.doffset + (header.dcount - 1) * sizeof(WadDescriptor);
+  pread(fd, &last, sizeof(last), at);
+  ASSERT_EQ(strncmp(last.name, "mp.txt", 8), 0);
+  memset(last.name, 0, sizeof(last.name));
+  pwrite(fd, &last, sizeof(last), at);
+  close(fd);
+
+  //A lump with an empty name is kept, not taken for a free slot
+  Wad* testWad = Wad::loadWad(wad_path);
+  std::vector<std::string> testVector;
+  ASSERT_EQ(testWad->getDirectory("/", &testVector), 3);
+  ASSERT_EQ(testVector[2], "");
+  testWad->createFile("/new.txt");
+  ASSERT_EQ(testWad->writeToFile("/new.txt", "new", 3), 3);
+  delete testWad;
+
+  fd = open(wad_path.c_str(), O_RDONLY);
+  pread(fd, &header, sizeof(header), 0);
+  std::vector<WadDescriptor> descriptors(header.dcount);
+  pread(fd, descriptors.data(), header.dcount * sizeof(WadDescriptor), header.doffset);
+  close(fd);
+  ASSERT_EQ(descriptors.size(), 20u);
+  ASSERT_EQ(descriptors[18].offset, 30019u);
+  ASSERT_EQ(descriptors[18].size, 398u);
+  ASSERT_EQ(strncmp(descriptors[19].name, "new.txt", 8), 0);
+}
+
+TEST(LibSlackTests, appendsAndSlots){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_SLACK);
+
+  testWad->createDirectory("/Ex");
+  testWad->createFile("/Ex/a.txt");
+  testWad->createFile("/Ex/b.txt");
+  testWad->createFile("/c.txt");
+  std::string expected;
+  for (int i = 0; i < 1000; ++i) {
+    std::string chunk = std::to_string(i) + ",";
+    ASSERT_EQ(testWad->writeToFile("/Ex/b.txt", chunk.data(), chunk.size(), expected.size()), (int)chunk.size());
+    expected += chunk;
+  }
+  delete testWad;
+
+  //Free slots are invisible, with or without WAD_SLACK
+  for (int flags : { 0, WAD_SLACK }) {
+    testWad = Wad::loadWad(wad_path, flags);
+    std::vector<std::string> testVector;
+    ASSERT_EQ(testWad->getDirectory("/", &testVector), 5);
+    std::vector<std::string> expectedVector = { "E1M0", "Gl", "mp.txt", "Ex", "c.txt" };
+    ASSERT_EQ(testVector, expectedVector);
+    testVector.clear();
+    ASSERT_EQ(testWad->getDirectory("/Ex", &testVector), 2);
+    ASSERT_EQ(testWad->getSize("/Ex/a.txt"), 0);
+    ASSERT_EQ(testWad->getSize("/Ex/b.txt"), (int)expected.size());
+    std::vector<char> buffer(expected.size());
+    ASSERT_EQ(testWad->getContents("/Ex/b.txt", buffer.data(), buffer.size()), (int)expected.size());
+    ASSERT_EQ(memcmp(buffer.data(), expected.data(), expected.size()), 0);
+    ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+    delete testWad;
+  }
+
+  //A slack WAD can still be extended without WAD_SLACK
+  testWad = Wad::loadWad(wad_path);
+  testWad->createFile("/Ex/d.txt");
+  ASSERT_EQ(testWad->writeToFile("/Ex/d.txt", "data", 4), 4);
+  delete testWad;
+  testWad = Wad::loadWad(wad_path);
+  std::vector<std::string> testVector;
+  ASSERT_EQ(testWad->getDirectory("/Ex", &testVector), 3);
+  char buffer[4];
+  ASSERT_EQ(testWad->getContents("/Ex/d.txt", buffer, 4), 4);
+  ASSERT_EQ(memcmp(buffer, "data", 4), 0);
+  delete testWad;
+}
+
+TEST(LibOverwriteTests, randomAccessWrites){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_OVERWRITE);
+
+  //Overwriting in place
+  ASSERT_EQ(testWad->writeToFile("/E1M0/01.txt", "HELLO", 5, 2), 5);
+  char buffer[64];
+  ASSERT_EQ(testWad->getContents("/E1M0/01.txt", buffer, 17), 17);
+  ASSERT_EQ(memcmp(buffer + 2, "HELLO", 5), 0);
+
+  //Growing a lump in the middle of the file relocates it
+  char original[12];
+  ASSERT_EQ(testWad->getContents("/E1M0/02.txt", original, 12), 12);
+  ASSERT_EQ(testWad->writeToFile("/E1M0/02.txt", "0123456789", 10, 20), 10);
+  ASSERT_EQ(testWad->getSize("/E1M0/02.txt"), 30);
+  ASSERT_EQ(testWad->getContents("/E1M0/02.txt", buffer, 30), 30);
+  ASSERT_EQ(memcmp(buffer, original, 12), 0);
+  for (int i = 12; i < 20; ++i) {
+    ASSERT_EQ(buffer[i], 0);
+  }
+  ASSERT_EQ(memcmp(buffer + 20, "0123456789", 10), 0);
+
+  //Its old extent is reused
+  testWad->createFile("/small");
+  ASSERT_EQ(testWad->writeToFile("/small", "abcdefghijkl", 12), 12);
+
+  //Neighbours are untouched
+  char neighbour[12];
+  ASSERT_EQ(testWad->getContents("/E1M0/03.txt", neighbour, 12), 12);
+
+  delete testWad;
+  testWad = Wad::loadWad(wad_path);
+  ASSERT_EQ(testWad->getContents("/E1M0/02.txt", buffer, 30), 30);
+  ASSERT_EQ(memcmp(buffer, original, 12), 0);
+  ASSERT_EQ(memcmp(buffer + 20, "0123456789", 10), 0);
+  ASSERT_EQ(testWad->getContents("/small", buffer, 12), 12);
+  ASSERT_EQ(memcmp(buffer, "abcdefghijkl", 12), 0);
+  ASSERT_EQ(testWad->getContents("/E1M0/03.txt", buffer, 12), 12);
+  ASSERT_EQ(memcmp(buffer, neighbour, 12), 0);
+  ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+
+  //Without WAD_OVERWRITE the old rules still apply
+  ASSERT_EQ(testWad->writeToFile("/E1M0/01.txt", "x", 1, 0), 0);
+
+  delete testWad;
+}
+
+TEST(LibCompactTests, compact){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_OVERWRITE);
+
+  //Scatter some lumps and leave holes behind
+  ASSERT_EQ(testWad->writeToFile("/E1M0/02.txt", "0123456789", 10, 12), 10);
+  ASSERT_EQ(testWad->writeToFile("/E1M0/05.txt", "abcdefghijklmnop", 16, 12), 16);
+  testWad->createFile("/Gl/new");
+  ASSERT_EQ(testWad->writeToFile("/Gl/new", "zzzz", 4), 4);
+
+  std::vector<std::string> lumps = {
+    "/E1M0/01.txt", "/E1M0/02.txt", "/E1M0/05.txt", "/E1M0/10.txt",
+    "/Gl/ad/os/cake.jpg", "/Gl/new", "/mp.txt"
+  };
+  std::vector<std::string> contents;
+  for (std::string& lump : lumps) {
+    std::string data(testWad->getSize(lump), 0);
+    ASSERT_EQ(testWad->getContents(lump, &data[0], data.size()), (int)data.size());
+    contents.push_back(data);
+  }
+
+  //Compact in small steps
+  int steps = 0;
+  int ret;
+  while ((ret = testWad->compact(64)) > 0) {
+    ++steps;
+  }
+  ASSERT_EQ(ret, 0);
+  ASSERT_GT(steps, 1);
+  ASSERT_EQ(testWad->compact(), 0);
+
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < lumps.size(); ++i) {
+      std::string data(contents[i].size(), 0);
+      ASSERT_EQ(testWad->getContents(lumps[i], &data[0], data.size()), (int)data.size());
+      ASSERT_EQ(data, contents[i]);
+    }
+    delete testWad;
+    testWad = Wad::loadWad(wad_path);
+  }
+
+  //Lumps are back to back in table order with the table right after them
+  int fd = open(wad_path.c_str(), O_RDONLY);
+  WadHeader header;
+  pread(fd, &header, sizeof(header), 0);
+  std::vector<WadDescriptor> table(header.dcount);
+  pread(fd, table.data(), table.size() * sizeof(WadDescriptor), header.doffset);
+  uint32_t pos = sizeof(WadHeader);
+  for (WadDescriptor& desc : table) {
+    if (desc.size) {
+      ASSERT_EQ(desc.offset, pos);
+      pos += desc.size;
+    }
+  }
+  ASSERT_EQ(header.doffset, pos);
+  ASSERT_EQ(lseek(fd, 0, SEEK_END), pos + table.size() * sizeof(WadDescriptor));
+  close(fd);
+
+  delete testWad;
+}
+
+//The file on disk stays readable at every step, even with write-back
+TEST(LibCompactTests, compactWriteback){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_OVERWRITE | WAD_WRITEBACK);
+  ASSERT_EQ(testWad->writeToFile("/E1M0/02.txt", "0123456789", 10, 12), 10);
+  ASSERT_EQ(testWad->writeToFile("/E1M0/05.txt", "abcdefghijklmnop", 16, 12), 16);
+  ASSERT_EQ(testWad->flush(), 0);
+
+  std::vector<std::string> lumps = { "/E1M0/02.txt", "/E1M0/05.txt", "/Gl/ad/os/cake.jpg", "/mp.txt" };
+  std::vector<std::string> contents;
+  for (std::string& lump : lumps) {
+    std::string data(testWad->getSize(lump), 0);
+    ASSERT_EQ(testWad->getContents(lump, &data[0], data.size()), (int)data.size());
+    contents.push_back(data);
+  }
+
+  int ret;
+  do {
+    ret = testWad->compact(64);
+    ASSERT_GE(ret, 0);
+    Wad* diskWad = Wad::loadWad(wad_path);
+    for (size_t i = 0; i < lumps.size(); ++i) {
+      std::string data(contents[i].size(), 0);
+      ASSERT_EQ(diskWad->getContents(lumps[i], &data[0], data.size()), (int)data.size());
+      ASSERT_EQ(data, contents[i]);
+    }
+    delete diskWad;
+  } while (ret > 0);
+  delete testWad;
+}
+
+TEST(LibBatchTests, batchedCreates){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  testWad->beginBatch();
+  testWad->createDirectory("/Ex");
+  testWad->createFile("/Ex/a.txt");
+  testWad->createDirectory("/Ex/in");
+  testWad->createFile("/Ex/in/b.txt");
+  testWad->createFile("/Gl/ad/c.txt");
+  testWad->createFile("/d.txt");
+  ASSERT_EQ(testWad->writeToFile("/Ex/in/b.txt", "batched", 7), 7);
+
+  //Entries are visible before the commit
+  ASSERT_TRUE(testWad->isDirectory("/Ex/in"));
+  ASSERT_TRUE(testWad->isContent("/Gl/ad/c.txt"));
+  ASSERT_EQ(testWad->getSize("/Ex/in/b.txt"), 7);
+  ASSERT_EQ(testWad->commitBatch(), 0);
+
+  for (int pass = 0; pass < 2; ++pass) {
+    std::vector<std::string> testVector;
+    ASSERT_EQ(testWad->getDirectory("/", &testVector), 5);
+    std::vector<std::string> expectedVector = { "E1M0", "Gl", "mp.txt", "Ex", "d.txt" };
+    ASSERT_EQ(testVector, expectedVector);
+
+    testVector.clear();
+    ASSERT_EQ(testWad->getDirectory("/Ex", &testVector), 2);
+    expectedVector = { "a.txt", "in" };
+    ASSERT_EQ(testVector, expectedVector);
+
+    testVector.clear();
+    ASSERT_EQ(testWad->getDirectory("/Gl/ad", &testVector), 2);
+    expectedVector = { "os", "c.txt" };
+    ASSERT_EQ(testVector, expectedVector);
+
+    char buffer[7];
+    ASSERT_EQ(testWad->getContents("/Ex/in/b.txt", buffer, 7), 7);
+    ASSERT_EQ(memcmp(buffer, "batched", 7), 0);
+    ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+    ASSERT_EQ(testWad->getSize("/mp.txt"), 398);
+
+    delete testWad;
+    testWad = Wad::loadWad(wad_path);
+  }
+
+  delete testWad;
+}
+
+TEST(LibThreadTests, readersAndWriter){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_MMAP);
+
+  std::string expected(398, 0);
+  ASSERT_EQ(testWad->getContents("/mp.txt", expected.data(), 398), 398);
+
+  std::atomic<bool> stop = false;
+  std::atomic<int> bad = 0;
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&]() {
+      std::string buffer(398, 0);
+      while (!stop) {
+        std::vector<std::string> entries;
+        if (testWad->getContents("/mp.txt", buffer.data(), 398) != 398 || buffer != expected
+            || testWad->getDirectory("/Gl/ad", &entries) < 1) {
+          ++bad;
+        }
+      }
+    });
+  }
+
+  char name[] = "/Gl/ad/f00";
+  for (int i = 0; i < 100; ++i) {
+    name[8] = '0' + i / 10;
+    name[9] = '0' + i % 10;
+    testWad->createFile(name);
+    ASSERT_EQ(testWad->writeToFile(name, name, 10), 10);
+  }
+  stop = true;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  ASSERT_EQ(bad, 0);
+
+  std::vector<std::string> testVector;
+  ASSERT_EQ(testWad->getDirectory("/Gl/ad", &testVector), 101);
+  char buffer[10];
+  ASSERT_EQ(testWad->getContents("/Gl/ad/f42", buffer, 10), 10);
+  ASSERT_EQ(memcmp(buffer, "/Gl/ad/f42", 10), 0);
+
+  delete testWad;
+}
+
+TEST(LibNodeTests, walkAndAccess){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  uint32_t gl = testWad->getChild(0, "Gl");
+  uint32_t ad = testWad->getChild(gl, "ad");
+  uint32_t os = testWad->getChild(ad, "os");
+  uint32_t cake = testWad->getChild(os, "cake.jpg");
+  ASSERT_NE(cake, WAD_NONE);
+  ASSERT_EQ(testWad->getNode("/Gl/ad/os/cake.jpg"), cake);
+  ASSERT_EQ(testWad->getPath(cake), "/Gl/ad/os/cake.jpg");
+  ASSERT_EQ(testWad->getPath(0), "/");
+  ASSERT_EQ(testWad->getChild(cake, "x"), WAD_NONE);
+  ASSERT_EQ(testWad->getChild(os, "nope"), WAD_NONE);
+  ASSERT_EQ(testWad->getParent(cake), os);
+  ASSERT_EQ(testWad->getParent(gl), 0u);
+  ASSERT_EQ(testWad->getParent(0), WAD_NONE);
+  ASSERT_EQ(testWad->getParent(WAD_NONE), WAD_NONE);
+
+  //What the low-level readdir and splice read use
+  std::vector<WadEntry> entries;
+  ASSERT_EQ(testWad->listDirectory(os, &entries), 1);
+  ASSERT_EQ(entries[0].node, cake);
+  ASSERT_EQ(testWad->getParent(entries[0].node), os);
+  int fd;
+  uint32_t offset;
+  ASSERT_EQ(testWad->getExtent(cake, &fd, &offset), 29869);
+  char jpeg[2];
+  ASSERT_EQ(pread(fd, jpeg, 2, offset), 2);
+  ASSERT_EQ(memcmp(jpeg, "\xff\xd8", 2), 0);
+  ASSERT_EQ(testWad->getExtent(os, &fd, &offset), -1);
+
+  ASSERT_TRUE(testWad->isDirectory(os));
+  ASSERT_TRUE(testWad->isContent(cake));
+  ASSERT_FALSE(testWad->isContent(WAD_NONE));
+  ASSERT_EQ(testWad->getSize(cake), 29869);
+
+  std::vector<uint32_t> children;
+  std::vector<std::string> names;
+  ASSERT_EQ(testWad->getChildren(0, &children), 3);
+  ASSERT_EQ(testWad->getDirectory(0, &names), 3);
+  ASSERT_EQ(children[1], gl);
+  ASSERT_EQ(names[1], "Gl");
+
+  testWad->createFile("/Gl/ad/new");
+  uint32_t node = testWad->getChild(ad, "new");
+  ASSERT_EQ(testWad->writeToFile(node, "abcdef", 6), 6);
+  char buffer[6];
+  ASSERT_EQ(testWad->getContents(node, buffer, 4, 2), 4);
+  ASSERT_EQ(memcmp(buffer, "cdef", 4), 0);
+  //Node ids survive the table moving around them
+  ASSERT_EQ(testWad->getSize(cake), 29869);
+  ASSERT_EQ(testWad->getPath(node), "/Gl/ad/new");
+
+  delete testWad;
+}
+
+TEST(LibListTests, listDirectory){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  std::vector<WadEntry> entries;
+  ASSERT_EQ(testWad->listDirectory("/", &entries), 3);
+  ASSERT_EQ(entries[0].name, "E1M0");
+  ASSERT_TRUE(entries[0].directory);
+  ASSERT_EQ(entries[2].name, "mp.txt");
+  ASSERT_FALSE(entries[2].directory);
+  ASSERT_EQ(entries[2].size, 398);
+  ASSERT_EQ(entries[2].node, testWad->getNode("/mp.txt"));
+
+  entries.clear();
+  ASSERT_EQ(testWad->listDirectory("/Gl/ad/os", &entries), 1);
+  ASSERT_EQ(entries[0].name, "cake.jpg");
+  ASSERT_EQ(entries[0].size, 29869);
+
+  ASSERT_EQ(testWad->listDirectory("/mp.txt", &entries), -1);
+  ASSERT_EQ(testWad->listDirectory("/nope", &entries), -1);
+
+  delete testWad;
+}
+
+TEST(LibCacheTests, hitsMissesAndInvalidation){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  char buffer[398];
+  char expected[398];
+  ASSERT_EQ(testWad->getContents("/mp.txt", expected, 398), 398);
+  ASSERT_EQ(testWad->getCacheStats().misses, 0);
+
+  testWad->setCacheSize(4096);
+  ASSERT_EQ(testWad->getContents("/mp.txt", buffer, 100), 100);
+  ASSERT_EQ(testWad->getContents("/mp.txt", buffer + 100, 298, 100), 298);
+  ASSERT_EQ(memcmp(buffer, expected, 398), 0);
+  WadCacheStats stats = testWad->getCacheStats();
+  ASSERT_EQ(stats.hits, 1);
+  ASSERT_EQ(stats.misses, 1);
+  ASSERT_EQ(stats.bytes, 398);
+  ASSERT_EQ(stats.entries, 1);
+
+  //Too big for the cache: read around it
+  ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", buffer, 10), 10);
+  ASSERT_EQ(testWad->getCacheStats().entries, 1);
+
+  testWad->createFile("/Gl/ad/new");
+  ASSERT_EQ(testWad->writeToFile("/Gl/ad/new", "abc", 3), 3);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/new", buffer, 6), 3);
+  ASSERT_EQ(testWad->writeToFile("/Gl/ad/new", "def", 3, 3), 3);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/new", buffer, 6), 6);
+  ASSERT_EQ(memcmp(buffer, "abcdef", 6), 0);
+  ASSERT_EQ(testWad->getCacheStats().misses, 3);
+
+  testWad->setCacheSize(0);
+  ASSERT_EQ(testWad->getCacheStats().entries, 0);
+  ASSERT_EQ(testWad->getCacheStats().bytes, 0);
+
+  delete testWad;
+}
+
+TEST(LibBatchReadTests, getContentsBatch){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  const char *paths[] = { "/Gl/ad/os/cake.jpg", "/mp.txt", "/E1M0/01.txt", "/E1M0/05.txt", "/Gl/ad", "/nope" };
+  std::vector<std::vector<char>> buffers;
+  std::vector<WadRead> reads;
+  for (const char *path : paths) {
+    buffers.emplace_back(40000);
+    reads.push_back({ testWad->getNode(path), buffers.back().data(), 40000, 0, 0 });
+  }
+  reads[1].offset = 100;
+  reads[1].length = 50;
+  //Same lump twice, back to back
+  buffers.emplace_back(40000);
+  reads.push_back({ testWad->getNode("/mp.txt"), buffers.back().data(), 100, 0, 0 });
+  for (size_t i = 0; i < reads.size(); ++i) {
+    reads[i].buffer = buffers[i].data();
+  }
+
+  ASSERT_EQ(testWad->getContentsBatch(reads.data(), reads.size()), -1);
+  ASSERT_EQ(reads[0].result, 29869);
+  ASSERT_EQ(reads[1].result, 50);
+  ASSERT_EQ(reads[4].result, -1);
+  ASSERT_EQ(reads[5].result, -1);
+  ASSERT_EQ(reads[6].result, 100);
+  for (size_t i : { 0, 1, 2, 3, 6 }) {
+    std::vector<char> expected(40000);
+    ASSERT_EQ(testWad->getContents(reads[i].node, expected.data(), reads[i].length, reads[i].offset), reads[i].result);
+    ASSERT_EQ(memcmp(expected.data(), buffers[i].data(), reads[i].result), 0);
+  }
+
+  ASSERT_EQ(testWad->getContentsBatch(reads.data() + 6, 1), 0);
+  ASSERT_EQ(testWad->getContentsBatch(nullptr, 0), 0);
+
+  delete testWad;
+}
+
+TEST(LibAsyncTests, readsAndWrites){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  int fd = testWad->getCompletionFd();
+  ASSERT_GE(fd, 0);
+  auto wait = [&](int count) {
+    int ran = 0;
+    while (ran < count) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      ASSERT_EQ(poll(&pfd, 1, 5000), 1);
+      ran += testWad->runCompletions();
+    }
+  };
+
+  std::vector<char> cake(29869);
+  char mp[398];
+  int cake_result = 0, mp_result = 0, bad_result = 0;
+  testWad->getContentsAsync(testWad->getNode("/Gl/ad/os/cake.jpg"), cake.data(), 40000, 0,
+      [&](int result) { cake_result = result; });
+  testWad->getContentsAsync(testWad->getNode("/mp.txt"), mp, 398, 0,
+      [&](int result) { mp_result = result; });
+  testWad->getContentsAsync(WAD_NONE, mp, 10, 0, [&](int result) { bad_result = result; });
+  //Callbacks only ever run from runCompletions
+  ASSERT_EQ(cake_result, 0);
+  ASSERT_EQ(bad_result, 0);
+  wait(3);
+  ASSERT_EQ(cake_result, 29869);
+  ASSERT_EQ(mp_result, 398);
+  ASSERT_EQ(bad_result, -1);
+
+  std::vector<char> expected(29869);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", expected.data(), 29869), 29869);
+  ASSERT_EQ(cake, expected);
+
+  testWad->createFile("/Gl/ad/new");
+  uint32_t node = testWad->getNode("/Gl/ad/new");
+  int write_result = 0;
+  testWad->writeToFileAsync(node, "abcdef", 6, 0, [&](int result) { write_result = result; });
+  ASSERT_EQ(testWad->getSize(node), 6);
+  wait(1);
+  ASSERT_EQ(write_result, 6);
+  char buffer[6];
+  ASSERT_EQ(testWad->getContents(node, buffer, 6), 6);
+  ASSERT_EQ(memcmp(buffer, "abcdef", 6), 0);
+
+  //Outstanding requests finish before the Wad goes away
+  testWad->getContentsAsync(node, buffer, 6, 0, [&](int result) { write_result = 100 + result; });
+  delete testWad;
+  ASSERT_EQ(write_result, 106);
+
+  testWad = Wad::loadWad(wad_path);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/new", buffer, 6), 6);
+  ASSERT_EQ(memcmp(buffer, "abcdef", 6), 0);
+  delete testWad;
+}
+
+TEST(LibAsyncTests, cacheAndMoves){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+  testWad->setCacheSize(1 << 20);
+
+  int fd = testWad->getCompletionFd();
+  ASSERT_GE(fd, 0);
+  auto wait = [&](int count) {
+    int ran = 0;
+    while (ran < count) {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      ASSERT_EQ(poll(&pfd, 1, 5000), 1);
+      ran += testWad->runCompletions();
+    }
+  };
+
+  //A lump with a write in flight is not cached until the write is done
+  testWad->createFile("/Gl/ad/new");
+  uint32_t node = testWad->getNode("/Gl/ad/new");
+  ASSERT_EQ(testWad->writeToFile(node, "abc", 3), 3);
+  int write_result = 0;
+  testWad->writeToFileAsync(node, "defg", 4, 3, [&](int result) { write_result = result; });
+  char buffer[7];
+  ASSERT_EQ(testWad->getContents(node, buffer, 7), 7);
+  ASSERT_EQ(testWad->getCacheStats().entries, 0u);
+  wait(1);
+  ASSERT_EQ(write_result, 4);
+  ASSERT_EQ(testWad->getContents(node, buffer, 7), 7);
+  ASSERT_EQ(memcmp(buffer, "abcdefg", 7), 0);
+  ASSERT_EQ(testWad->getCacheStats().entries, 1u);
+  ASSERT_EQ(testWad->getContents(node, buffer, 7), 7);
+  ASSERT_EQ(memcmp(buffer, "abcdefg", 7), 0);
+
+  //Compact and dedup wait for reads still in flight
+  std::vector<char> expected(29869);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", expected.data(), 29869), 29869);
+  std::vector<char> cake(29869), again(29869);
+  int cake_result = 0, again_result = 0;
+  testWad->getContentsAsync(testWad->getNode("/Gl/ad/os/cake.jpg"), cake.data(), 29869, 0,
+      [&](int result) { cake_result = result; });
+  ASSERT_GE(testWad->compact(), 0);
+  testWad->getContentsAsync(testWad->getNode("/Gl/ad/os/cake.jpg"), again.data(), 29869, 0,
+      [&](int result) { again_result = result; });
+  ASSERT_GE(testWad->dedup(), 0);
+  wait(2);
+  ASSERT_EQ(cake_result, 29869);
+  ASSERT_EQ(again_result, 29869);
+  ASSERT_EQ(cake, expected);
+  ASSERT_EQ(again, expected);
+
+  delete testWad;
+}
+
+//sample1 with three bytes of padding before its table, so that the table is aligned
+static std::string alignedWorkspace(int *fd)
+{
+  std::vector<char> data(30721);
+  int in = open("sample1.wad", O_RDONLY);
+  pread(in, data.data(), data.size(), 0);
+  close(in);
+  uint32_t doffset;
+  memcpy(&doffset, data.data() + 8, 4);
+  data.insert(data.begin() + doffset, 3, 0);
+  doffset += 3;
+  memcpy(data.data() + 8, &doffset, 4);
+  *fd = memfd_create("test_aligned", 0);
+  pwrite(*fd, data.data(), data.size(), 0);
+  return "/proc/self/fd/" + std::to_string(*fd);
+}
+
+TEST(LibLazyTests, lazyIndex){
+  int fd;
+  std::string wad_path = alignedWorkspace(&fd);
+  Wad* eagerWad = Wad::loadWad(wad_path);
+  Wad* testWad = Wad::loadWad(wad_path, WAD_LAZY);
+
+  ASSERT_EQ(testWad->getMagic(), "IWAD");
+  ASSERT_TRUE(testWad->isContent("/Gl/ad/os/cake.jpg"));
+  ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+  ASSERT_TRUE(testWad->isDirectory("/E1M0"));
+  ASSERT_FALSE(testWad->isContent("/Gl/ad/nope"));
+
+  //Listing a directory never looked inside
+  std::vector<std::string> testVector;
+  std::vector<std::string> expectedVector;
+  ASSERT_EQ(testWad->getDirectory("/E1M0", &testVector), eagerWad->getDirectory("/E1M0", &expectedVector));
+  ASSERT_EQ(testVector, expectedVector);
+  uint32_t gl = testWad->getChild(0, "Gl");
+  ASSERT_EQ(testWad->getPath(testWad->getChild(gl, "ad")), "/Gl/ad");
+  testVector.clear();
+  expectedVector.clear();
+  ASSERT_EQ(testWad->getDirectory("/", &testVector), 3);
+  ASSERT_EQ(eagerWad->getDirectory("/", &expectedVector), 3);
+  ASSERT_EQ(testVector, expectedVector);
+
+  std::vector<char> buffer(29869), expected(29869);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", buffer.data(), 29869), 29869);
+  ASSERT_EQ(eagerWad->getContents("/Gl/ad/os/cake.jpg", expected.data(), 29869), 29869);
+  ASSERT_EQ(buffer, expected);
+  delete eagerWad;
+
+  //The first change reads in the rest
+  testWad->createFile("/Gl/new");
+  ASSERT_EQ(testWad->writeToFile("/Gl/new", "abc", 3), 3);
+  ASSERT_EQ(testWad->getSize("/mp.txt"), 398);
+  delete testWad;
+
+  testWad = Wad::loadWad(wad_path, WAD_LAZY);
+  testVector.clear();
+  ASSERT_EQ(testWad->getDirectory("/Gl", &testVector), 2);
+  expectedVector = { "ad", "new" };
+  ASSERT_EQ(testVector, expectedVector);
+  char small[3];
+  ASSERT_EQ(testWad->getContents("/Gl/new", small, 3), 3);
+  ASSERT_EQ(memcmp(small, "abc", 3), 0);
+  delete testWad;
+  close(fd);
+}
+
+TEST(LibLazyTests, unalignedTable){
+  std::string wad_path = setupWorkspace();
+  int fd = open(wad_path.c_str(), O_RDONLY);
+  uint32_t doffset;
+  ASSERT_EQ(pread(fd, &doffset, 4, 8), 4);
+  close(fd);
+  ASSERT_EQ(doffset, 30417u);
+
+  //An odd table offset is read in instead of used in place
+  Wad* eagerWad = Wad::loadWad(wad_path);
+  Wad* testWad = Wad::loadWad(wad_path, WAD_LAZY);
+  for (const char *path : { "/", "/E1M0", "/Gl", "/Gl/ad", "/Gl/ad/os" }) {
+    std::vector<std::string> testVector, expectedVector;
+    ASSERT_EQ(testWad->getDirectory(path, &testVector), eagerWad->getDirectory(path, &expectedVector));
+    ASSERT_EQ(testVector, expectedVector);
+  }
+  ASSERT_EQ(testWad->getSize("/E1M0/07.txt"), 19);
+  char buffer[19], expected[19];
+  ASSERT_EQ(testWad->getContents("/E1M0/07.txt", buffer, 19), 19);
+  ASSERT_EQ(eagerWad->getContents("/E1M0/07.txt", expected, 19), 19);
+  ASSERT_EQ(memcmp(buffer, expected, 19), 0);
+  delete eagerWad;
+  delete testWad;
+}
+
+//Rewrites the workspace WAD the way wad_compress does
+static void compressWorkspace(const std::string& wad_path)
+{
+  int fd = open(wad_path.c_str(), O_RDWR);
+  WadHeader header;
+  pread(fd, &header, sizeof(header), 0);
+  std::vector<WadDescriptor> descriptors(header.dcount);
+  pread(fd, descriptors.data(), header.dcount * sizeof(WadDescriptor), header.doffset);
+  std::string data;
+  for (WadDescriptor& desc : descriptors) {
+    std::vector<char> lump(desc.size);
+    pread(fd, lump.data(), desc.size, desc.offset);
+    std::string stored = wadEncode(lump.data(), desc.size);
+    desc.offset = sizeof(header) + data.size();
+    desc.size = stored.size();
+    data += stored;
+  }
+  memcpy(header.magic, "ZWAD", 4);
+  header.doffset = sizeof(header) + data.size();
+  ftruncate(fd, 0);
+  pwrite(fd, &header, sizeof(header), 0);
+  pwrite(fd, data.data(), data.size(), sizeof(header));
+  pwrite(fd, descriptors.data(), header.dcount * sizeof(WadDescriptor), header.doffset);
+  close(fd);
+}
+
+TEST(LibCompressTests, compressedRead){
+  std::string wad_path = setupWorkspace();
+  Wad* plainWad = Wad::loadWad(std::string("sample1.wad"));
+  compressWorkspace(wad_path);
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  ASSERT_EQ(testWad->getMagic(), "ZWAD");
+  ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+  ASSERT_EQ(testWad->getSize("/E1M0/01.txt"), 17);
+  std::vector<char> buffer(29869), expected(29869);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", buffer.data(), 29869), 29869);
+  ASSERT_EQ(plainWad->getContents("/Gl/ad/os/cake.jpg", expected.data(), 29869), 29869);
+  ASSERT_EQ(buffer, expected);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", buffer.data(), 100, 29800), 69);
+  ASSERT_EQ(memcmp(buffer.data(), expected.data() + 29800, 69), 0);
+  ASSERT_EQ(testWad->getContents("/Gl/ad/os/cake.jpg", buffer.data(), 10, 29869), 0);
+
+  std::vector<WadEntry> entries;
+  ASSERT_EQ(testWad->listDirectory("/E1M0", &entries), 10);
+  ASSERT_EQ(entries[0].size, 17u);
+
+  //No direct access to stored bytes
+  int fd;
+  uint32_t offset;
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/E1M0/01.txt"), &fd, &offset), -1);
+  delete testWad;
+  delete plainWad;
+}
+
+TEST(LibCompressTests, badFrame){
+  std::string wad_path = setupWorkspace();
+  compressWorkspace(wad_path);
+  Wad* testWad = Wad::loadWad(wad_path);
+  int fd = open(wad_path.c_str(), O_RDWR);
+  WadHeader header;
+  pread(fd, &header, sizeof(header), 0);
+  std::vector<WadDescriptor> descriptors(header.dcount);
+  pread(fd, descriptors.data(), header.dcount * sizeof(WadDescriptor), header.doffset);
+
+  //A chunk size past WAD_CHUNK_SIZE is refused before anything is allocated
+  uint32_t chunk_size = 1u << 30;
+  for (WadDescriptor& desc : descriptors) {
+    if (!strncmp(desc.name, "01.txt", 8)) {
+      pwrite(fd, &chunk_size, 4, desc.offset + desc.size - 8);
+    }
+  }
+  close(fd);
+  char buffer[17];
+  ASSERT_EQ(testWad->getContents("/E1M0/01.txt", buffer, 17), -1);
+  ASSERT_EQ(testWad->getContents("/E1M0/02.txt", buffer, 1), 1);
+
+  //Writes that would end past INT_MAX fail instead of wrapping
+  ASSERT_EQ(testWad->writeToFile("/E1M0/02.txt", "x", 1, INT_MAX), -1);
+  delete testWad;
+}
+
+TEST(LibCompressTests, compressedWrite){
+  std::string wad_path = setupWorkspace();
+  compressWorkspace(wad_path);
+  Wad* testWad = Wad::loadWad(wad_path);
+
+  //Large enough for several chunks, and compressible
+  std::string contents;
+  for (int i = 0; contents.size() < 3 * WAD_CHUNK_SIZE; ++i) {
+    contents += "line " + std::to_string(i * 7919 % 1000) + "\n";
+  }
+  testWad->createFile("/Gl/big");
+  ASSERT_EQ(testWad->writeToFile("/Gl/big", contents.data(), contents.size()), (int)contents.size());
+  ASSERT_EQ(testWad->getSize("/Gl/big"), (int)contents.size());
+
+  //Compressed lumps can be changed anywhere
+  ASSERT_EQ(testWad->writeToFile("/Gl/big", "XYZ", 3, WAD_CHUNK_SIZE - 1), 3);
+  contents.replace(WAD_CHUNK_SIZE - 1, 3, "XYZ");
+  ASSERT_EQ(testWad->writeToFile("/E1M0/01.txt", "!", 1, 17), 1);
+  delete testWad;
+
+  testWad = Wad::loadWad(wad_path);
+  std::vector<char> buffer(contents.size());
+  ASSERT_EQ(testWad->getContents("/Gl/big", buffer.data(), 10, WAD_CHUNK_SIZE - 4), 10);
+  ASSERT_EQ(memcmp(buffer.data(), contents.data() + WAD_CHUNK_SIZE - 4, 10), 0);
+  ASSERT_EQ(testWad->getContents("/Gl/big", buffer.data(), contents.size()), (int)contents.size());
+  ASSERT_EQ(memcmp(buffer.data(), contents.data(), contents.size()), 0);
+  ASSERT_EQ(testWad->getSize("/E1M0/01.txt"), 18);
+  char small[18];
+  ASSERT_EQ(testWad->getContents("/E1M0/01.txt", small, 18), 18);
+  ASSERT_EQ(small[17], '!');
+
+  //Stored well below its size
+  int fd = open(wad_path.c_str(), O_RDONLY);
+  ASSERT_LT(lseek(fd, 0, SEEK_END), (off_t)contents.size() / 2);
+  close(fd);
+  delete testWad;
+}
+
+TEST(LibDedupTests, sharedExtents){
+  std::string wad_path = setupWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path);
+  std::string contents(5000, 'x');
+  testWad->createFile("/Gl/a");
+  testWad->createFile("/Gl/b");
+  testWad->createFile("/Gl/c");
+  ASSERT_EQ(testWad->writeToFile("/Gl/a", contents.data(), 5000), 5000);
+  ASSERT_EQ(testWad->writeToFile("/Gl/b", contents.data(), 5000), 5000);
+  ASSERT_EQ(testWad->dedup(testWad->getNode("/Gl/b")), 5000);
+
+  //The duplicate was last, so its space is reused right away
+  ASSERT_EQ(testWad->writeToFile("/Gl/c", contents.data(), 5000), 5000);
+  ASSERT_EQ(testWad->dedup(testWad->getNode("/Gl/c")), 5000);
+  int fd;
+  uint32_t a, b, c;
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/Gl/a"), &fd, &a), 5000);
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/Gl/b"), &fd, &b), 5000);
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/Gl/c"), &fd, &c), 5000);
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(a, c);
+
+  //sample1 has its own duplicates: 02.txt, 04.txt and 05.txt; 03.txt and 06.txt
+  ASSERT_EQ(testWad->dedup(), 3 * 12);
+  ASSERT_EQ(testWad->dedup(), 0);
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/E1M0/05.txt"), &fd, &b), 12);
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/E1M0/02.txt"), &fd, &c), 12);
+  ASSERT_EQ(b, c);
+  delete testWad;
+
+  //Writes copy the extent first, even after a reload
+  testWad = Wad::loadWad(wad_path, WAD_OVERWRITE);
+  ASSERT_EQ(testWad->writeToFile("/Gl/b", "yy", 2, 100), 2);
+  std::vector<char> buffer(5000);
+  ASSERT_EQ(testWad->getContents("/Gl/a", buffer.data(), 5000), 5000);
+  ASSERT_EQ(std::string(buffer.data(), 5000), contents);
+  ASSERT_EQ(testWad->getContents("/Gl/b", buffer.data(), 5000), 5000);
+  ASSERT_EQ(std::string(buffer.data() + 99, 4), "xyyx");
+  ASSERT_EQ(testWad->getContents("/Gl/c", buffer.data(), 5000), 5000);
+  ASSERT_EQ(std::string(buffer.data(), 5000), contents);
+
+  //Compaction keeps one copy for a and c
+  while (testWad->compact() > 0);
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/Gl/a"), &fd, &a), 5000);
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/Gl/c"), &fd, &c), 5000);
+  ASSERT_EQ(a, c);
+  ASSERT_EQ(lseek(fd, 0, SEEK_END), 30721 - 3 * 12 + 2 * 5000 + 3 * 16);
+  ASSERT_EQ(testWad->getContents("/Gl/c", buffer.data(), 5000), 5000);
+  ASSERT_EQ(std::string(buffer.data(), 5000), contents);
+  ASSERT_EQ(testWad->getSize("/Gl/ad/os/cake.jpg"), 29869);
+  delete testWad;
+}
+
+//An empty PWAD in memory, for building layers
+static std::string emptyWad(int *fd)
+{
+  *fd = memfd_create("test_layer", 0);
+  WadHeader header = { { 'P', 'W', 'A', 'D' }, 0, sizeof(WadHeader) };
+  pwrite(*fd, &header, sizeof(header), 0);
+  return "/proc/self/fd/" + std::to_string(*fd);
+}
+
+TEST(LibStackTests, mergedIndex){
+  std::string base_path = setupWorkspace();
+  int fd1, fd2;
+  std::string path1 = emptyWad(&fd1);
+  std::string path2 = emptyWad(&fd2);
+
+  Wad* layer = Wad::loadWad(path1);
+  layer->createFile("/mp.txt");
+  layer->writeToFile("/mp.txt", "override", 8);
+  layer->createFile("/Gl");
+  layer->writeToFile("/Gl", "flat", 4);
+  layer->createDirectory("/zz");
+  layer->createFile("/zz/a");
+  delete layer;
+  layer = Wad::loadWad(path2);
+  layer->createDirectory("/Gl");
+  layer->createFile("/Gl/x");
+  layer->writeToFile("/Gl/x", "x", 1);
+  layer->createDirectory("/zz");
+  layer->createFile("/zz/b");
+  delete layer;
+
+  WadStack* testStack = WadStack::loadStack({ base_path, path1, path2 });
+  ASSERT_NE(testStack, nullptr);
+  ASSERT_EQ(testStack->getLayerCount(), 3u);
+
+  //Later files win
+  ASSERT_EQ(testStack->getSize("/mp.txt"), 8);
+  char buffer[8];
+  ASSERT_EQ(testStack->getContents("/mp.txt", buffer, 8), 8);
+  ASSERT_EQ(memcmp(buffer, "override", 8), 0);
+  ASSERT_EQ(testStack->getSize("/E1M0/01.txt"), 17);
+
+  //A file hides a directory, and a later directory hides the file
+  ASSERT_TRUE(testStack->isDirectory("/Gl"));
+  ASSERT_FALSE(testStack->isContent("/Gl/ad/os/cake.jpg"));
+  std::vector<std::string> testVector;
+  std::vector<std::string> expectedVector = { "x" };
+  ASSERT_EQ(testStack->getDirectory("/Gl", &testVector), 1);
+  ASSERT_EQ(testVector, expectedVector);
+  ASSERT_EQ(testStack->getContents("/Gl/x", buffer, 8), 1);
+
+  //Directories merge, in order of first appearance
+  testVector.clear();
+  expectedVector = { "E1M0", "Gl", "mp.txt", "zz" };
+  ASSERT_EQ(testStack->getDirectory("/", &testVector), 4);
+  ASSERT_EQ(testVector, expectedVector);
+  std::vector<WadEntry> entries;
+  ASSERT_EQ(testStack->listDirectory("/zz", &entries), 2);
+  ASSERT_EQ(entries[0].name, "a");
+  ASSERT_EQ(entries[1].name, "b");
+
+  uint32_t zz = testStack->getChild(0, "zz");
+  ASSERT_EQ(testStack->getChild(zz, "b"), entries[1].node);
+  ASSERT_EQ(testStack->getPath(entries[1].node), "/zz/b");
+  ASSERT_EQ(testStack->getNode("//zz//b/"), entries[1].node);
+  ASSERT_EQ(testStack->getChild(zz, "c"), WAD_NONE);
+  ASSERT_EQ(testStack->flush(), 0);
+  delete testStack;
+
+  ASSERT_EQ(WadStack::loadStack({ base_path, "/nonexistent.wad" }), nullptr);
+  close(fd1);
+  close(fd2);
+}
+
+TEST(LibWriterTests, streamingBuild){
+  int fd = memfd_create("test_writer", 0);
+  std::string wad_path = "/proc/self/fd/" + std::to_string(fd);
+  WadWriter* writer = WadWriter::createWad(wad_path);
+  ASSERT_NE(writer, nullptr);
+  ASSERT_TRUE(writer->beginDirectory("ab"));
+  ASSERT_EQ(writer->addLump("one", "first", 5), 0);
+  ASSERT_TRUE(writer->beginDirectory("c"));
+  ASSERT_EQ(writer->addLump("empty", nullptr, 0), 0);
+  ASSERT_TRUE(writer->endDirectory());
+  ASSERT_TRUE(writer->endDirectory());
+  uint32_t offset = writer->reserveLump("two", 6);
+  ASSERT_EQ(pwrite(writer->getFd(), "second", 6, offset), 6);
+
+  //Names that would not read back as written
+  ASSERT_FALSE(writer->beginDirectory("abc"));
+  ASSERT_EQ(writer->addLump("toolongname", "x", 1), -1);
+  ASSERT_EQ(writer->reserveLump("E1M1", 1), WAD_NONE);
+  ASSERT_EQ(writer->reserveLump("xx_START", 0), WAD_NONE);
+  ASSERT_FALSE(writer->endDirectory());
+  ASSERT_TRUE(wadIsMarker("E1M1"));
+  ASSERT_TRUE(wadIsMarker("F_END"));
+  ASSERT_FALSE(wadIsMarker("E1M1.txt"));
+  ASSERT_FALSE(wadIsMarker("two"));
+
+  ASSERT_EQ(writer->finish(), 0);
+  delete writer;
+
+
+  Wad* testWad = Wad::loadWad(wad_path);
+  ASSERT_EQ(testWad->getMagic(), "PWAD");
+  std::vector<std::string> testVector;
+  std::vector<std::string> expectedVector = { "ab", "two" };
+  ASSERT_EQ(testWad->getDirectory("/", &testVector), 2);
+  ASSERT_EQ(testVector, expectedVector);
+  ASSERT_TRUE(testWad->isDirectory("/ab/c"));
+  ASSERT_EQ(testWad->getSize("/ab/c/empty"), 0);
+  char buffer[6];
+  ASSERT_EQ(testWad->getContents("/ab/one", buffer, 6), 5);
+  ASSERT_EQ(memcmp(buffer, "first", 5), 0);
+  ASSERT_EQ(testWad->getContents("/two", buffer, 6), 6);
+  ASSERT_EQ(memcmp(buffer, "second", 6), 0);
+
+  //The result is an ordinary WAD
+  testWad->createFile("/three");
+  ASSERT_EQ(testWad->writeToFile("/three", "3", 1), 1);
+  delete testWad;
+  close(fd);
+}
+
+TEST(LibWriterTests, offsetLimits){
+  int fd = memfd_create("test_writer", 0);
+  std::string wad_path = "/proc/self/fd/" + std::to_string(fd);
+  WadWriter* writer = WadWriter::createWad(wad_path);
+
+  //Offsets are 32 bits: nothing may run past 4 GiB, the table included
+  ASSERT_EQ(writer->reserveLump("huge", UINT32_MAX), WAD_NONE);
+  ASSERT_EQ(writer->reserveLump("big", 0xf0000000), 12u);
+  ASSERT_EQ(writer->reserveLump("more", 0x10000000), WAD_NONE);
+  ASSERT_EQ(writer->reserveLump("last", 0x0ffffff0), 0xf000000cu);
+  ASSERT_EQ(writer->finish(), -1);
+  delete writer;
+  close(fd);
+}
+
+TEST(LibWriterTests, compressedBuild){
+  int fd = memfd_create("test_writer", 0);
+  std::string wad_path = "/proc/self/fd/" + std::to_string(fd);
+  ASSERT_EQ(WadWriter::createWad(wad_path, "XWAD"), nullptr);
+  WadWriter* writer = WadWriter::createWad(wad_path, "ZWAD");
+  ASSERT_NE(writer, nullptr);
+  std::string contents(3 * WAD_CHUNK_SIZE, 'z');
+  ASSERT_TRUE(writer->beginDirectory("zz"));
+  ASSERT_EQ(writer->addLump("big", contents.data(), contents.size()), 0);
+  ASSERT_EQ(writer->finish(), -1);
+  ASSERT_TRUE(writer->endDirectory());
+  ASSERT_EQ(writer->finish(), 0);
+  delete writer;
+
+  ASSERT_LT(lseek(fd, 0, SEEK_END), WAD_CHUNK_SIZE);
+  Wad* testWad = Wad::loadWad(wad_path);
+  ASSERT_EQ(testWad->getMagic(), "ZWAD");
+  ASSERT_EQ(testWad->getSize("/zz/big"), (int)contents.size());
+  std::vector<char> buffer(contents.size());
+  ASSERT_EQ(testWad->getContents("/zz/big", buffer.data(), contents.size()), (int)contents.size());
+  ASSERT_EQ(std::string(buffer.data(), buffer.size()), contents);
+  delete testWad;
+  close(fd);
+}
+
+//A copy of sample1 in a real directory, since the .crc file goes next to it
+static std::string checksumWorkspace()
+{
+  static char dir[] = "/tmp/libtest.XXXXXX";
+  static bool made = mkdtemp(dir);
+  mkdir(dir, 0700);
+  std::string wad_path = std::string(dir) + "/test.wad";
+  unlink((wad_path + ".crc").c_str());
+  int in = open("sample1.wad", O_RDONLY);
+  int out = open(wad_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  std::vector<char> data(30721);
+  pread(in, data.data(), data.size(), 0);
+  pwrite(out, data.data(), data.size(), 0);
+  close(in);
+  close(out);
+  return made ? wad_path : "";
+}
+
+TEST(LibChecksumTests, crc32c){
+  ASSERT_EQ(wadCrc32c(0, "123456789", 9), 0xe3069283u);
+  ASSERT_EQ(wadCrc32c(wadCrc32c(0, "1234", 4), "56789", 5), 0xe3069283u);
+  std::string long_data(1000, 'q');
+  ASSERT_EQ(wadCrc32c(wadCrc32c(0, long_data.data(), 333), long_data.data() + 333, 667),
+      wadCrc32c(0, long_data.data(), 1000));
+}
+
+TEST(LibChecksumTests, verify){
+  std::string wad_path = checksumWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_CHECKSUM);
+
+  //The first pass gives every lump a checksum
+  WadVerifyStats stats = testWad->verify();
+  ASSERT_EQ(stats.lumps, 0u);
+  ASSERT_EQ(stats.added, 12u);
+  ASSERT_EQ(stats.bytes, 30405u);
+  testWad->createFile("/Gl/new");
+  ASSERT_EQ(testWad->writeToFile("/Gl/new", "abc", 3), 3);
+  ASSERT_EQ(testWad->writeToFile("/Gl/new", "def", 3, 3), 3);
+  delete testWad;
+
+  testWad = Wad::loadWad(wad_path, WAD_CHECKSUM | WAD_OVERWRITE);
+  stats = testWad->verify(nullptr, 3);
+  ASSERT_EQ(stats.lumps, 13u);
+  ASSERT_EQ(stats.bad, 0u);
+  ASSERT_EQ(stats.added, 0u);
+
+  //Writes in the middle of a lump and ones that move it
+  ASSERT_EQ(testWad->writeToFile("/E1M0/01.txt", "XY", 2, 4), 2);
+  ASSERT_EQ(testWad->writeToFile("/E1M0/02.txt", "more data", 9, 12), 9);
+  stats = testWad->verify();
+  ASSERT_EQ(stats.lumps, 13u);
+  ASSERT_EQ(stats.bad, 0u);
+  while (testWad->compact() > 0);
+  delete testWad;
+
+  //Damage one lump behind libWad's back
+  testWad = Wad::loadWad(wad_path, WAD_CHECKSUM);
+  int fd;
+  uint32_t offset;
+  ASSERT_EQ(testWad->getExtent(testWad->getNode("/Gl/ad/os/cake.jpg"), &fd, &offset), 29869);
+  ASSERT_EQ(pwrite(fd, "!", 1, offset + 1000), 1);
+  std::vector<std::string> bad;
+  stats = testWad->verify(&bad);
+  ASSERT_EQ(stats.lumps, 13u);
+  ASSERT_EQ(stats.bad, 1u);
+  std::vector<std::string> expected = { "/Gl/ad/os/cake.jpg" };
+  ASSERT_EQ(bad, expected);
+  delete testWad;
+
+  //Without the flag nothing is known
+  testWad = Wad::loadWad(wad_path);
+  stats = testWad->verify();
+  ASSERT_EQ(stats.lumps, 0u);
+  ASSERT_EQ(stats.added, 0u);
+  delete testWad;
+
+  unlink(wad_path.c_str());
+  unlink((wad_path + ".crc").c_str());
+  rmdir(wad_path.substr(0, wad_path.rfind('/')).c_str());
+}
+
+TEST(LibChecksumTests, sharedAndSidecar){
+  std::string wad_path = checksumWorkspace();
+  Wad* testWad = Wad::loadWad(wad_path, WAD_CHECKSUM | WAD_OVERWRITE);
+  ASSERT_EQ(testWad->verify().added, 12u);
+
+  //Writing one of two lumps sharing an extent leaves the other its checksum
+  ASSERT_GT(testWad->dedup(), 0);
+  ASSERT_EQ(testWad->writeToFile("/E1M0/06.txt", "XY", 2, 4), 2);
+  //Lumps sharing an extent are checked once
+  WadVerifyStats stats = testWad->verify();
+  ASSERT_EQ(stats.lumps, 10u);
+  ASSERT_EQ(stats.bad, 0u);
+  ASSERT_EQ(stats.added, 0u);
+  delete testWad;
+
+  //A .crc file that does not hold the entries it claims is started over
+  std::string crc_path = wad_path + ".crc";
+  struct stat st;
+  ASSERT_EQ(stat(crc_path.c_str(), &st), 0);
+  ASSERT_EQ(truncate(crc_path.c_str(), st.st_size - 4), 0);
+  testWad = Wad::loadWad(wad_path, WAD_CHECKSUM);
+  stats = testWad->verify();
+  ASSERT_EQ(stats.lumps, 0u);
+  ASSERT_EQ(stats.added, 10u);
+  delete testWad;
+  testWad = Wad::loadWad(wad_path, WAD_CHECKSUM);
+  ASSERT_EQ(testWad->verify().lumps, 10u);
+  delete testWad;
+
+  int cfd = open(crc_path.c_str(), O_WRONLY | O_TRUNC);
+  uint32_t head[2] = { 0, 0xffffffff };
+  memcpy(head, "WCRC", 4);
+  ASSERT_EQ(write(cfd, head, sizeof(head)), (ssize_t)sizeof(head));
+  close(cfd);
+  testWad = Wad::loadWad(wad_path, WAD_CHECKSUM);
+  stats = testWad->verify();
+  ASSERT_EQ(stats.lumps, 0u);
+  ASSERT_EQ(stats.added, 10u);
+  delete testWad;
+
+  unlink(wad_path.c_str());
+  unlink(crc_path.c_str());
+  rmdir(wad_path.substr(0, wad_path.rfind('/')).c_str());
+}
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Wad.h"
+
+/*
+ * Compact a WAD in place: lumps are rewritten back to back in directory
+ * order and dead space is dropped. With -b, work in steps of at most
+ * that many bytes, the way a mounted wadfs would in the background.
+ */
+
+static void usage()
+{
+  std::cerr << "usage: wad_compact [-b budget] file.wad\n";
+}
+
+static long file_size(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) ? -1 : st.st_size;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t budget = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:h")) != -1) {
+    switch (opt) {
+      case 'b':
+        budget = strtoul(optarg, nullptr, 0);
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage();
+    return 2;
+  }
+
+  const char *path = argv[optind];
+  long before = file_size(path);
+  Wad *wad = Wad::loadWad(path);
+  if (!wad) {
+    perror(path);
+    return 1;
+  }
+
+  int steps = 0;
+  int ret;
+  while ((ret = wad->compact(budget)) > 0) {
+    ++steps;
+  }
+  delete wad;
+  if (ret < 0) {
+    std::cerr << path << ": compaction failed\n";
+    return 1;
+  }
+
+  std::cout << path << ": " << before << " -> " << file_size(path) << " bytes";
+  if (budget) {
+    std::cout << " in " << steps + 1 << " steps";
+  }
+  std::cout << "\n";
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <iostream>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Wad.h"
+
+/*
+ * Write a compressed copy of a WAD. The descriptor table is kept as it
+ * is; every lump is run through wadEncode and the copy gets a ZWAD
+ * magic, which libWad reads and writes transparently.
+ */
+
+static void usage()
+{
+  std::cerr << "usage: wad_compress in.wad out.wad\n";
+}
+
+static bool read_all(int fd, void *buf, size_t size, off_t offset)
+{
+  return pread(fd, buf, size, offset) == (ssize_t)size;
+}
+
+static bool write_all(int fd, const void *buf, size_t size, off_t offset)
+{
+  return pwrite(fd, buf, size, offset) == (ssize_t)size;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3) {
+    usage();
+    return 2;
+  }
+
+  int in = open(argv[1], O_RDONLY);
+  if (in < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  WadHeader header;
+  if (!read_all(in, &header, sizeof(header), 0)
+      || (memcmp(header.magic, "IWAD", 4) && memcmp(header.magic, "PWAD", 4))) {
+    std::cerr << argv[1] << ": not an uncompressed WAD\n";
+    return 1;
+  }
+  std::vector<WadDescriptor> descriptors(header.dcount);
+  if (!read_all(in, descriptors.data(), descriptors.size() * sizeof(WadDescriptor), header.doffset)) {
+    std::cerr << argv[1] << ": short descriptor table\n";
+    return 1;
+  }
+
+  int out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  uint64_t before = 0;
+  uint32_t pos = sizeof(header);
+  std::vector<char> lump;
+  for (WadDescriptor& desc : descriptors) {
+    if (!desc.size) {
+      continue;
+    }
+    lump.resize(desc.size);
+    if (!read_all(in, lump.data(), desc.size, desc.offset)) {
+      std::cerr << argv[1] << ": short lump " << std::string(desc.name, strnlen(desc.name, 8)) << "\n";
+      return 1;
+    }
+    std::string data = wadEncode(lump.data(), desc.size);
+    if (data.size() > UINT32_MAX - pos) {
+      std::cerr << argv[2] << ": would not fit below 4 GiB\n";
+      return 1;
+    }
+    if (!write_all(out, data.data(), data.size(), pos)) {
+      perror(argv[2]);
+      return 1;
+    }
+    before += desc.size;
+    desc.offset = pos;
+    desc.size = data.size();
+    pos += data.size();
+  }
+
+  memcpy(header.magic, "ZWAD", 4);
+  header.doffset = pos;
+  if (!write_all(out, descriptors.data(), descriptors.size() * sizeof(WadDescriptor), pos)
+      || !write_all(out, &header, sizeof(header), 0) || close(out)) {
+    perror(argv[2]);
+    return 1;
+  }
+  close(in);
+
+  std::cout << argv[2] << ": " << before << " -> " << pos - sizeof(header) << " bytes of lumps\n";
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <sys/stat.h>
+#include "Wad.h"
+
+/*
+ * Deduplicate a WAD in place: lumps with identical contents are pointed
+ * at a single copy, then the file is compacted to drop the others.
+ * libWad gives a shared lump its own copy again when it is written.
+ */
+
+static long file_size(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) ? -1 : st.st_size;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2) {
+    std::cerr << "usage: wad_dedup file.wad\n";
+    return 2;
+  }
+
+  const char *path = argv[1];
+  long before = file_size(path);
+  Wad *wad = Wad::loadWad(path);
+  if (!wad) {
+    perror(path);
+    return 1;
+  }
+
+  int shared = wad->dedup();
+  if (shared < 0) {
+    delete wad;
+    std::cerr << path << ": dedup failed\n";
+    return 1;
+  }
+  int ret;
+  while ((ret = wad->compact()) > 0);
+  delete wad;
+  if (ret < 0) {
+    std::cerr << path << ": compaction failed\n";
+    return 1;
+  }
+
+  std::cout << path << ": " << before << " -> " << file_size(path) << " bytes, "
+      << shared << " bytes shared\n";
+  return 0;
+}
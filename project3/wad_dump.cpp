@@ -8,25 +8,21 @@ void exploreDirectory(Wad *data, const string path, int level)
     for (int index = 0; index < level; index++)
         cout << " ";
 
-    vector<string> entries;
-    cout << "[Objects at this level:" << data->getDirectory(path, &entries) << "]" << endl;
+    vector<WadEntry> entries;
+    cout << "[Objects at this level:" << data->listDirectory(path, &entries) << "]" << endl;
 
-    for (string entry : entries)
+    for (WadEntry& entry : entries)
     {
-        string entryPath = path + entry;
-
         for (int index = 0; index < level; index++)
             cout << " ";
 
-        if (data->isDirectory(entryPath))
+        if (entry.directory)
         {
-            cout << level << ". DIR: " << entry << endl;
-            exploreDirectory(data, entryPath + "/", level + 1);
+            cout << level << ". DIR: " << entry.name << endl;
+            exploreDirectory(data, path + entry.name + "/", level + 1);
         }
-        else if (data->isContent(entryPath))
-            cout << level << ". CONTENT: " << entry << "; Size: " << data->getSize(entryPath) << endl;
         else
-            cout << "***WARNING: entry " << entry << " has invalid type!***" << endl;
+            cout << level << ". CONTENT: " << entry.name << "; Size: " << entry.size << endl;
     }
 }
 
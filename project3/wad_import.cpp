@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Wad.h"
+
+/*
+ * Import a host directory tree into an existing WAD. Everything is
+ * created inside one batch, so the descriptor table is merged and
+ * written once at the end no matter how many entries there are.
+ *
+ * WAD names are short: directories can have at most two characters
+ * (they become XX_START/XX_END markers) and files at most eight.
+ * Anything that does not fit is skipped with a warning.
+ *
+ * With -d, each file is deduplicated against the lumps already in the
+ * WAD as soon as it has been written, so a duplicate's space is reused
+ * by the next file.
+ */
+
+static bool dedup;
+static int files;
+static int dirs;
+static long long bytes;
+static long long shared;
+
+static bool import_file(Wad *wad, const std::string& src, const std::string& dst)
+{
+  wad->createFile(dst);
+  if (!wad->isContent(dst) || wad->getSize(dst)) {
+    return false;
+  }
+  int fd = open(src.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char buf[65536];
+  int offset = 0;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    if (wad->writeToFile(dst, buf, n, offset) != n) {
+      break;
+    }
+    offset += n;
+  }
+  close(fd);
+  if (dedup && n == 0) {
+    shared += std::max(wad->dedup(wad->getNode(dst)), 0);
+  }
+  ++files;
+  bytes += offset;
+  return n == 0;
+}
+
+static void import_dir(Wad *wad, const std::string& src, const std::string& dst)
+{
+  DIR *dir = opendir(src.c_str());
+  if (!dir) {
+    perror(src.c_str());
+    return;
+  }
+  std::vector<std::string> names;
+  while (struct dirent *ent = readdir(dir)) {
+    if (ent->d_name[0] != '.') {
+      names.push_back(ent->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (std::string& name : names) {
+    std::string from = src + "/" + name;
+    std::string to = dst + (dst == "/" ? "" : "/") + name;
+    struct stat st;
+    if (stat(from.c_str(), &st)) {
+      perror(from.c_str());
+    } else if (S_ISDIR(st.st_mode)) {
+      wad->createDirectory(to);
+      if (wad->isDirectory(to)) {
+        ++dirs;
+        import_dir(wad, from, to);
+      } else {
+        std::cerr << "skipping " << from << ": cannot create " << to << "\n";
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      if (!import_file(wad, from, to)) {
+        std::cerr << "skipping " << from << ": cannot create " << to << "\n";
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "dh")) != -1) {
+    switch (opt) {
+      case 'd':
+        dedup = true;
+        break;
+      default:
+        std::cerr << "usage: wad_import [-d] file.wad hostdir [wadpath]\n";
+        return 2;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 3 || argc > 4) {
+    std::cerr << "usage: wad_import [-d] file.wad hostdir [wadpath]\n";
+    return 2;
+  }
+
+  Wad *wad = Wad::loadWad(argv[1]);
+  if (!wad) {
+    perror(argv[1]);
+    return 1;
+  }
+  std::string dst = argc > 3 ? argv[3] : "/";
+  if (!wad->isDirectory(dst)) {
+    std::cerr << dst << ": not a directory in " << argv[1] << "\n";
+    delete wad;
+    return 1;
+  }
+
+  wad->beginBatch();
+  import_dir(wad, argv[2], dst);
+  int ret = wad->commitBatch();
+  delete wad;
+
+  std::cout << "imported " << files << " files (" << bytes << " bytes) and "
+      << dirs << " directories";
+  if (dedup) {
+    std::cout << ", " << shared << " bytes shared";
+  }
+  std::cout << "\n";
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Wad.h"
+
+/*
+ * Pack a host directory tree into a new WAD in one pass. The tree is
+ * walked first, which fixes where every lump goes; the files are then
+ * copied into place by a pool of threads, with copy_file_range so the
+ * data does not pass through here. With -z the WAD is a ZWAD, and the
+ * threads read and compress a window of files at a time, which is then
+ * written out in order.
+ *
+ * Names follow wad_import: directories of at most two characters and
+ * files of at most eight that do not look like markers (E1M1, X_START,
+ * X_END); anything else is skipped with a warning.
+ */
+
+struct Item
+{
+  enum { LUMP, BEGIN, END } kind;
+  std::string name;
+  std::string path;
+  uint32_t size;
+  uint32_t offset;
+};
+
+static std::vector<Item> items;
+
+static void usage()
+{
+  std::cerr << "usage: wad_pack [-z] [-j threads] hostdir out.wad\n";
+}
+
+static void walk(const std::string& src)
+{
+  DIR *dir = opendir(src.c_str());
+  if (!dir) {
+    perror(src.c_str());
+    return;
+  }
+  std::vector<std::string> names;
+  while (struct dirent *ent = readdir(dir)) {
+    if (ent->d_name[0] != '.') {
+      names.push_back(ent->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (std::string& name : names) {
+    std::string from = src + "/" + name;
+    struct stat st;
+    if (stat(from.c_str(), &st)) {
+      perror(from.c_str());
+    } else if (S_ISDIR(st.st_mode) && name.size() <= 2) {
+      items.push_back({ Item::BEGIN, name, from, 0, 0 });
+      walk(from);
+      items.push_back({ Item::END, name, from, 0, 0 });
+    } else if (S_ISREG(st.st_mode) && name.size() <= 8 && !wadIsMarker(name) && st.st_size <= UINT32_MAX) {
+      items.push_back({ Item::LUMP, name, from, (uint32_t)st.st_size, 0 });
+    } else {
+      std::cerr << "skipping " << from << ": cannot be stored in a WAD\n";
+    }
+  }
+}
+
+/* Runs job(i) for every i below count on threads threads. */
+template <typename Job>
+static void run_parallel(int threads, size_t count, Job job)
+{
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; ++t) {
+    pool.emplace_back([&]() {
+      for (size_t i; (i = next++) < count;) {
+        job(i);
+      }
+    });
+  }
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+}
+
+static bool copy_file(const Item& item, int out)
+{
+  int in = open(item.path.c_str(), O_RDONLY);
+  if (in < 0) {
+    return false;
+  }
+  loff_t from = 0;
+  loff_t to = item.offset;
+  uint32_t size = item.size;
+  while (size) {
+    ssize_t n = copy_file_range(in, &from, out, &to, size, 0);
+    if (n <= 0) {
+      break;
+    }
+    size -= n;
+  }
+  char buf[65536];
+  while (size) {
+    ssize_t n = pread(in, buf, std::min<uint32_t>(size, sizeof(buf)), from);
+    if (n <= 0 || pwrite(out, buf, n, to) != n) {
+      break;
+    }
+    from += n;
+    to += n;
+    size -= n;
+  }
+  close(in);
+  return !size;
+}
+
+static bool read_file(const Item& item, std::string& data)
+{
+  int in = open(item.path.c_str(), O_RDONLY);
+  if (in < 0) {
+    return false;
+  }
+  data.resize(item.size);
+  uint32_t done = 0;
+  while (done < item.size) {
+    ssize_t n = pread(in, &data[done], item.size - done, done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(in);
+  return done == item.size;
+}
+
+/* Directories and files up to (not including) end, in order. */
+static bool emit(WadWriter *writer, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; ++i) {
+    Item& item = items[i];
+    bool ok = item.kind == Item::BEGIN ? writer->beginDirectory(item.name)
+        : item.kind == Item::END ? writer->endDirectory()
+        : (item.offset = writer->reserveLump(item.name, item.size)) != WAD_NONE;
+    if (!ok) {
+      std::cerr << item.path << ": cannot be stored in a WAD\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool pack(WadWriter *writer, int threads)
+{
+  if (!emit(writer, 0, items.size())) {
+    return false;
+  }
+  std::atomic<bool> ok(true);
+  run_parallel(threads, items.size(), [&](size_t i) {
+    if (items[i].kind == Item::LUMP && items[i].size && !copy_file(items[i], writer->getFd())) {
+      perror(items[i].path.c_str());
+      ok = false;
+    }
+  });
+  return ok;
+}
+
+static bool pack_compressed(WadWriter *writer, int threads)
+{
+  std::vector<size_t> files;
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (items[i].kind == Item::LUMP) {
+      files.push_back(i);
+    }
+  }
+  size_t window = threads * 4;
+  std::vector<std::string> stored(window);
+  size_t done = 0;
+  for (size_t first = 0; first < files.size(); first += window) {
+    size_t count = std::min(window, files.size() - first);
+    std::atomic<bool> ok(true);
+    run_parallel(threads, count, [&](size_t i) {
+      Item& item = items[files[first + i]];
+      std::string raw;
+      if (!ok) {
+        return;
+      }
+      if (!read_file(item, raw)) {
+        perror(item.path.c_str());
+        ok = false;
+        return;
+      }
+      stored[i] = wadEncode(raw.data(), raw.size());
+      item.size = stored[i].size();
+    });
+    if (!ok || !emit(writer, done, files[first + count - 1] + 1)) {
+      return false;
+    }
+    done = files[first + count - 1] + 1;
+    for (size_t i = 0; i < count; ++i) {
+      Item& item = items[files[first + i]];
+      if (pwrite(writer->getFd(), stored[i].data(), item.size, item.offset) != item.size) {
+        perror(item.path.c_str());
+        return false;
+      }
+    }
+  }
+  return emit(writer, done, items.size());
+}
+
+int main(int argc, char **argv)
+{
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  bool compress = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hj:z")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'z':
+        compress = true;
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+  if (argc - optind != 2 || threads < 1) {
+    usage();
+    return 2;
+  }
+  const char *src = argv[optind];
+  const char *dst = argv[optind + 1];
+
+  auto start = std::chrono::steady_clock::now();
+  walk(src);
+  WadWriter *writer = WadWriter::createWad(dst, compress ? "ZWAD" : "PWAD");
+  if (!writer) {
+    perror(dst);
+    return 1;
+  }
+  bool ok = compress ? pack_compressed(writer, threads) : pack(writer, threads);
+  if (!ok || writer->finish()) {
+    std::cerr << dst << ": packing failed\n";
+    delete writer;
+    return 1;
+  }
+  delete writer;
+
+  int files = 0;
+  long long bytes = 0;
+  for (Item& item : items) {
+    if (item.kind == Item::LUMP) {
+      ++files;
+    }
+  }
+  struct stat st;
+  if (!stat(dst, &st)) {
+    bytes = st.st_size;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "packed " << files << " files into " << bytes << " bytes in "
+      << elapsed.count() << " s (" << bytes / elapsed.count() / 1e6 << " MB/s)\n";
+  return 0;
+}
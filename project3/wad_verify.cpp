@@ -0,0 +1,61 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <unistd.h>
+#include "Wad.h"
+
+/*
+ * Check every lump of a WAD against the checksums in its .crc file. The
+ * first run, or one after lumps were written without WAD_CHECKSUM, gives
+ * the lumps that have none a checksum instead.
+ */
+
+static void usage()
+{
+  std::cerr << "usage: wad_verify [-j threads] file.wad\n";
+}
+
+int main(int argc, char **argv)
+{
+  int threads = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hj:")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+  if (argc - optind != 1) {
+    usage();
+    return 2;
+  }
+
+  const char *path = argv[optind];
+  Wad *wad = Wad::loadWad(path, WAD_CHECKSUM);
+  if (!wad) {
+    perror(path);
+    return 1;
+  }
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::string> bad;
+  WadVerifyStats stats = wad->verify(&bad, threads);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  int ret = wad->flush();
+  delete wad;
+
+  for (std::string& lump : bad) {
+    std::cout << "BAD " << lump << "\n";
+  }
+  std::cout << path << ": " << stats.lumps << " checked, " << stats.bad << " bad, "
+      << stats.added << " added; " << stats.bytes << " bytes in " << elapsed.count()
+      << " s (" << stats.bytes / elapsed.count() / 1e6 << " MB/s)\n";
+  if (ret) {
+    std::cerr << path << ".crc: cannot be written\n";
+  }
+  return stats.bad || ret ? 1 : 0;
+}
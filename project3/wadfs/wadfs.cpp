@@ -1,19 +1,52 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fuse/fuse.h>
+#include <fuse/fuse_lowlevel.h>
 
 #include "Wad.h"
 
 std::unique_ptr<Wad> wad;
+std::unique_ptr<WadStack> stack;
+
+/*
+ * Cache settings. These are the usual FUSE option names: the high-level
+ * library handles them itself, so for it they are only looked at and
+ * passed on; the low-level backend has to apply them in its replies.
+ *
+ * Every write to a lump goes through the kernel, which updates its own
+ * page cache and file size as it sends the write, and lumps are never
+ * changed behind its back (wadfs does not use WAD_OVERWRITE, compact or
+ * dedup, so data already written is never rewritten or freed, only
+ * copied when a lump shared since an earlier dedup is appended to). So
+ * kernel_cache is safe here, and the
+ * only things that need telling are new entries, which are replied to
+ * as they are created.
+ */
+static struct {
+  bool lowlevel;
+  double entry_timeout = 1.0;
+  double attr_timeout = 1.0;
+  bool kernel_cache;
+  bool splice_read;
+} config;
 
 int wadfs_getattr(const char *path, struct stat *st)
 {
-  if (wad->isContent(path)) {
+  int size = wad->getSize(path);
+  if (size >= 0) {
     st->st_mode = S_IFREG | 0777;
-    st->st_size = wad->getSize(path);
+    st->st_size = size;
     return 0;
   } else if (wad->isDirectory(path)) {
     st->st_mode = S_IFDIR | 0777;
@@ -35,65 +68,470 @@ int wadfs_mkdir(const char *path, mode_t mode)
   return 0;
 }
 
+/*
+ * open and create resolve the path once and keep a handle in fi->fh: the
+ * node id, which read and write then use directly, and whether anything
+ * was written through it. Only then does release flush, so closing a
+ * file that was just read does not take the Wad lock for writing.
+ */
+struct wadfs_handle
+{
+  uint32_t node;
+  std::atomic<bool> written;
+};
+
+static wadfs_handle *handle(struct fuse_file_info *fi)
+{
+  return reinterpret_cast<wadfs_handle *>(fi->fh);
+}
+
+static void set_handle(struct fuse_file_info *fi, uint32_t node)
+{
+  fi->fh = reinterpret_cast<uint64_t>(new wadfs_handle { node, { false } });
+}
+
+int wadfs_open(const char *path, struct fuse_file_info *fi)
+{
+  uint32_t node = wad->getNode(path);
+  if (node == WAD_NONE) {
+    return -ENOENT;
+  } else if (!wad->isContent(node)) {
+    return -EISDIR;
+  }
+  set_handle(fi, node);
+  return 0;
+}
+
+int wadfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  wad->createFile(path);
+  uint32_t node = wad->getNode(path);
+  if (!wad->isContent(node)) {
+    return -EPERM;
+  }
+  set_handle(fi, node);
+  return 0;
+}
+
 int wadfs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
 {
-  int res = wad->getContents(path, buf, len, offset);
+  int res = wad->getContents(handle(fi)->node, buf, len, offset);
   return res < 0 ? -EPERM : res;
 }
 
 int wadfs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
 {
-  return wad->writeToFile(path, buf, len, offset) == (int)len ? len : -EPERM;
+  handle(fi)->written = true;
+  return wad->writeToFile(handle(fi)->node, buf, len, offset) == (int)len ? len : -EPERM;
+}
+
+int wadfs_release(const char *path, struct fuse_file_info *fi)
+{
+  bool written = handle(fi)->written;
+  delete handle(fi);
+  return written && wad->flush() ? -EIO : 0;
+}
+
+int wadfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  return wad->flush() ? -EIO : 0;
 }
 
 int wadfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
-  std::vector<std::string> entries;
-  if (wad->getDirectory(path, &entries) == -1) {
+  std::vector<WadEntry> entries;
+  if (wad->listDirectory(path, &entries) == -1) {
     return -ENOTDIR;
   }
   filler(buf, ".", nullptr, 0);
   filler(buf, "..", nullptr, 0);
-  for (std::string& entry : entries) {
-    filler(buf, entry.c_str(), nullptr, 0);
+  for (WadEntry& entry : entries) {
+    struct stat st {};
+    st.st_mode = entry.directory ? S_IFDIR | 0777 : S_IFREG | 0777;
+    st.st_size = entry.size;
+    filler(buf, entry.name.c_str(), &st, 0);
   }
   return 0;
 }
 
+/* Large writes are worth having whenever the kernel offers them; splice
+ * is left to the splice_read/splice_write/splice_move options. */
+static void wadfs_init_conn(struct fuse_conn_info *conn)
+{
+  if (conn->capable & FUSE_CAP_BIG_WRITES) {
+    conn->want |= FUSE_CAP_BIG_WRITES;
+  }
+}
+
+void *wadfs_init(struct fuse_conn_info *conn)
+{
+  wadfs_init_conn(conn);
+  return nullptr;
+}
+
+void wadfs_destroy(void *private_data)
+{
+  wad->flush();
+}
+
 struct fuse_operations wadfs_ops = {
   .getattr = wadfs_getattr,
   .mknod = wadfs_mknod,
   .mkdir = wadfs_mkdir,
+  .open = wadfs_open,
   .read = wadfs_read,
   .write = wadfs_write,
-  .readdir = wadfs_readdir
+  .release = wadfs_release,
+  .fsync = wadfs_fsync,
+  .readdir = wadfs_readdir,
+  .init = wadfs_init,
+  .destroy = wadfs_destroy,
+  .create = wadfs_create
 };
 
-static void usage()
+/*
+ * Several sources are mounted as a WadStack, later ones over earlier
+ * ones. The stack is read-only; the node ids kept in fi->fh are its own.
+ */
+
+int wadfs_stack_getattr(const char *path, struct stat *st)
+{
+  uint32_t node = stack->getNode(path);
+  if (stack->isContent(node)) {
+    st->st_mode = S_IFREG | 0555;
+    st->st_size = stack->getSize(node);
+    return 0;
+  } else if (stack->isDirectory(node)) {
+    st->st_mode = S_IFDIR | 0555;
+    return 0;
+  } else {
+    return -ENOENT;
+  }
+}
+
+int wadfs_stack_open(const char *path, struct fuse_file_info *fi)
+{
+  uint32_t node = stack->getNode(path);
+  if (node == WAD_NONE) {
+    return -ENOENT;
+  } else if (!stack->isContent(node)) {
+    return -EISDIR;
+  } else if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EROFS;
+  }
+  fi->fh = node;
+  return 0;
+}
+
+int wadfs_stack_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+  int res = stack->getContents(fi->fh, buf, len, offset);
+  return res < 0 ? -EPERM : res;
+}
+
+int wadfs_stack_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+  std::vector<WadEntry> entries;
+  if (stack->listDirectory(path, &entries) == -1) {
+    return -ENOTDIR;
+  }
+  filler(buf, ".", nullptr, 0);
+  filler(buf, "..", nullptr, 0);
+  for (WadEntry& entry : entries) {
+    struct stat st {};
+    st.st_mode = entry.directory ? S_IFDIR | 0555 : S_IFREG | 0555;
+    st.st_size = entry.size;
+    filler(buf, entry.name.c_str(), &st, 0);
+  }
+  return 0;
+}
+
+void wadfs_stack_destroy(void *private_data)
+{
+  stack->flush();
+}
+
+struct fuse_operations wadfs_stack_ops = {
+  .getattr = wadfs_stack_getattr,
+  .open = wadfs_stack_open,
+  .read = wadfs_stack_read,
+  .readdir = wadfs_stack_readdir,
+  .init = wadfs_init,
+  .destroy = wadfs_stack_destroy
+};
+
+/*
+ * Low-level backend (-l). Inode numbers are Wad node ids plus one, which
+ * makes the root FUSE_ROOT_ID. Lookups resolve one name at a time and
+ * everything else goes straight to the node, so no path is ever parsed.
+ */
+
+static bool wadfs_ll_stat(fuse_ino_t ino, struct stat *st)
+{
+  uint32_t node = ino - 1;
+  int size = wad->getSize(node);
+  *st = {};
+  st->st_ino = ino;
+  if (size >= 0) {
+    st->st_mode = S_IFREG | 0777;
+    st->st_size = size;
+  } else if (wad->isDirectory(node)) {
+    st->st_mode = S_IFDIR | 0777;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void wadfs_ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param e {};
+  uint32_t node = wad->getChild(parent - 1, name);
+  if (node == WAD_NONE || !wadfs_ll_stat((fuse_ino_t)node + 1, &e.attr)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  e.ino = (fuse_ino_t)node + 1;
+  e.attr_timeout = config.attr_timeout;
+  e.entry_timeout = config.entry_timeout;
+  fuse_reply_entry(req, &e);
+}
+
+void wadfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  wadfs_ll_reply_entry(req, parent, name);
+}
+
+void wadfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct stat st;
+  if (!wadfs_ll_stat(ino, &st)) {
+    fuse_reply_err(req, ENOENT);
+  } else {
+    fuse_reply_attr(req, &st, config.attr_timeout);
+  }
+}
+
+void wadfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+  if (wad->getChild(parent - 1, name) != WAD_NONE) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  wad->createFile(wad->getPath(parent - 1) + "/" + name);
+  wadfs_ll_reply_entry(req, parent, name);
+}
+
+void wadfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  if (wad->getChild(parent - 1, name) != WAD_NONE) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  wad->createDirectory(wad->getPath(parent - 1) + "/" + name);
+  wadfs_ll_reply_entry(req, parent, name);
+}
+
+void wadfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  uint32_t node = ino - 1;
+  if (!wad->isContent(node)) {
+    fuse_reply_err(req, wad->isDirectory(node) ? EISDIR : ENOENT);
+    return;
+  }
+  fi->keep_cache = config.kernel_cache;
+  set_handle(fi, node);
+  if (fuse_reply_open(req, fi)) {
+    delete handle(fi);
+  }
+}
+
+/* With splice_read the reply points the kernel at the lump in the WAD
+ * file itself, so the data is spliced across without passing through
+ * a buffer here. */
+void wadfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-  std::cerr << "usage: wadfs [-fs] source mountpoint\n";
+  int fd;
+  uint32_t pos;
+  int lump_size;
+  if (config.splice_read && (lump_size = wad->getExtent(ino - 1, &fd, &pos)) >= 0) {
+    if (off >= lump_size) {
+      fuse_reply_buf(req, nullptr, 0);
+      return;
+    }
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(std::min<size_t>(size, lump_size - off));
+    bufv.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    bufv.buf[0].fd = fd;
+    bufv.buf[0].pos = pos + off;
+    fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+    return;
+  }
+  std::vector<char> buf(size);
+  int res = wad->getContents(ino - 1, buf.data(), size, off);
+  if (res < 0) {
+    fuse_reply_err(req, EPERM);
+  } else {
+    fuse_reply_buf(req, buf.data(), res);
+  }
 }
 
-static const char *debug_argv[] = { "", "-d" };
-static struct fuse_args debug_args = FUSE_ARGS_INIT(2, const_cast<char **>(debug_argv));
+void wadfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  handle(fi)->written = true;
+  if (wad->writeToFile(ino - 1, buf, size, off) != (int)size) {
+    fuse_reply_err(req, EPERM);
+  } else {
+    fuse_reply_write(req, size);
+  }
+}
+
+void wadfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  bool written = handle(fi)->written;
+  delete handle(fi);
+  fuse_reply_err(req, written && wad->flush() ? EIO : 0);
+}
+
+void wadfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, wad->flush() ? EIO : 0);
+}
+
+/* The whole listing is built on every call and the requested window of it
+ * returned, as in the FUSE examples; directories here are small. */
+void wadfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  std::vector<WadEntry> entries;
+  if (wad->listDirectory(ino - 1, &entries) == -1) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  std::string buf;
+  auto add = [&](const char *name, fuse_ino_t child, mode_t mode) {
+    struct stat st {};
+    st.st_ino = child;
+    st.st_mode = mode;
+    size_t at = buf.size();
+    buf.resize(at + fuse_add_direntry(req, nullptr, 0, name, nullptr, 0));
+    fuse_add_direntry(req, &buf[at], buf.size() - at, name, &st, buf.size());
+  };
+  add(".", ino, S_IFDIR);
+  uint32_t parent = wad->getParent(ino - 1);
+  add("..", parent == WAD_NONE ? ino : (fuse_ino_t)parent + 1, S_IFDIR);
+  for (WadEntry& entry : entries) {
+    add(entry.name.c_str(), (fuse_ino_t)entry.node + 1, entry.directory ? S_IFDIR : S_IFREG);
+  }
+  if ((size_t)off >= buf.size()) {
+    fuse_reply_buf(req, nullptr, 0);
+  } else {
+    fuse_reply_buf(req, buf.data() + off, std::min(buf.size() - off, size));
+  }
+}
+
+void wadfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  wadfs_init_conn(conn);
+}
+
+void wadfs_ll_destroy(void *userdata)
+{
+  wad->flush();
+}
+
+struct fuse_lowlevel_ops wadfs_ll_ops = {
+  .init = wadfs_ll_init,
+  .destroy = wadfs_ll_destroy,
+  .lookup = wadfs_ll_lookup,
+  .getattr = wadfs_ll_getattr,
+  .mknod = wadfs_ll_mknod,
+  .mkdir = wadfs_ll_mkdir,
+  .open = wadfs_ll_open,
+  .read = wadfs_ll_read,
+  .write = wadfs_ll_write,
+  .release = wadfs_ll_release,
+  .fsync = wadfs_ll_fsync,
+  .readdir = wadfs_ll_readdir
+};
+
+enum {
+  KEY_ENTRY_TIMEOUT,
+  KEY_ATTR_TIMEOUT,
+  KEY_KERNEL_CACHE,
+  KEY_SPLICE_READ,
+};
+
+static const struct fuse_opt wadfs_opts[] = {
+  FUSE_OPT_KEY("entry_timeout=", KEY_ENTRY_TIMEOUT),
+  FUSE_OPT_KEY("attr_timeout=", KEY_ATTR_TIMEOUT),
+  FUSE_OPT_KEY("kernel_cache", KEY_KERNEL_CACHE),
+  FUSE_OPT_KEY("splice_read", KEY_SPLICE_READ),
+  FUSE_OPT_END
+};
+
+/* Returning 1 passes the option on to libfuse. */
+static int wadfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+  switch (key) {
+    case KEY_ENTRY_TIMEOUT:
+      config.entry_timeout = atof(strchr(arg, '=') + 1);
+      return !config.lowlevel;
+    case KEY_ATTR_TIMEOUT:
+      config.attr_timeout = atof(strchr(arg, '=') + 1);
+      return !config.lowlevel;
+    case KEY_KERNEL_CACHE:
+      config.kernel_cache = true;
+      return !config.lowlevel;
+    case KEY_SPLICE_READ:
+      config.splice_read = true;
+      return 1;
+    default:
+      return 1;
+  }
+}
+
+static void usage()
+{
+  std::cerr << "usage: wadfs [-cflmsw] [-o options] source... mountpoint\n";
+}
 
 /* See lib/helper.c in FUSE source. */
 int main(int argc, char **argv)
 {
-  bool debug = false;
   bool foreground = false;
+  bool single = false;
+  bool lowlevel = false;
+  int flags = 0;
   int opt;
+  struct fuse_args args = FUSE_ARGS_INIT(0, nullptr);
+  fuse_opt_add_arg(&args, "wadfs");
 
-  while ((opt = getopt(argc, argv, "dfhs")) != -1) {
+  while ((opt = getopt(argc, argv, "cdfhlmo:sw")) != -1) {
     switch (opt) {
+      case 'c':
+        flags |= WAD_CHECKSUM;
+        break;
       case 'd':
-        debug = true;
         foreground = true;
+        fuse_opt_add_arg(&args, "-d");
         break;
       case 'f':
         foreground = true;
         break;
+      case 'l':
+        lowlevel = true;
+        break;
+      case 'm':
+        flags |= WAD_MMAP;
+        break;
+      case 'o':
+        fuse_opt_add_arg(&args, "-o");
+        fuse_opt_add_arg(&args, optarg);
+        break;
       case 's':
+        single = true;
+        break;
+      case 'w':
+        flags |= WAD_WRITEBACK;
         break;
       default:
         usage();
@@ -104,35 +542,76 @@ int main(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
-  if (argc != 2) {
+  if (argc < 2 || (argc > 2 && lowlevel)) {
     usage();
     return 2;
   }
 
-  const char *source = argv[0];
-  const char *mountpoint = argv[1];
+  std::vector<std::string> sources(argv, argv + argc - 1);
+  const char *mountpoint = argv[argc - 1];
 
-  wad.reset(Wad::loadWad(source));
+  config.lowlevel = lowlevel;
+  if (fuse_opt_parse(&args, nullptr, wadfs_opts, wadfs_opt_proc)) {
+    usage();
+    return 2;
+  }
+
+  if (sources.size() > 1) {
+    stack.reset(WadStack::loadStack(sources, flags));
+    if (!stack) {
+      std::cerr << "cannot load all of the sources\n";
+      fuse_opt_free_args(&args);
+      return 1;
+    }
+  } else {
+    wad.reset(Wad::loadWad(sources[0], flags));
+    if (!wad) {
+      perror(sources[0].c_str());
+      fuse_opt_free_args(&args);
+      return 1;
+    }
+    wad->setFlushInterval(1000);
+  }
 
   int ret = 1;
   struct fuse_chan *ch;
-  if (!(ch = fuse_mount(mountpoint, debug ? &debug_args : nullptr))) {
+  if (!(ch = fuse_mount(mountpoint, &args))) {
+    fuse_opt_free_args(&args);
     return 1;
   }
   struct fuse *fuse = nullptr;
-  if (!(fuse = fuse_new(ch, debug ? &debug_args : nullptr, &wadfs_ops, sizeof(wadfs_ops), nullptr))) {
-    goto finish;
+  struct fuse_session *se = nullptr;
+  if (lowlevel) {
+    if (!(se = fuse_lowlevel_new(&args, &wadfs_ll_ops, sizeof(wadfs_ll_ops), nullptr))) {
+      goto finish;
+    }
+    fuse_session_add_chan(se, ch);
+  } else {
+    const struct fuse_operations *ops = stack ? &wadfs_stack_ops : &wadfs_ops;
+    if (!(fuse = fuse_new(ch, &args, ops, sizeof(*ops), nullptr))) {
+      goto finish;
+    }
+    se = fuse_get_session(fuse);
   }
   fuse_daemonize(foreground);
-  if (fuse_set_signal_handlers(fuse_get_session(fuse))) {
+  if (fuse_set_signal_handlers(se)) {
     goto finish;
   }
-  ret = fuse_loop(fuse);
-  fuse_remove_signal_handlers(fuse_get_session(fuse));
+  if (lowlevel) {
+    ret = single ? fuse_session_loop(se) : fuse_session_loop_mt(se);
+  } else {
+    ret = single ? fuse_loop(fuse) : fuse_loop_mt(fuse);
+  }
+  fuse_remove_signal_handlers(se);
 finish:
+  if (lowlevel && se) {
+    fuse_session_remove_chan(ch);
+    fuse_session_destroy(se);
+  }
   fuse_unmount(mountpoint, ch);
   if (fuse) {
     fuse_destroy(fuse);
   }
+  fuse_opt_free_args(&args);
   return ret;
 }